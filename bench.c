@@ -0,0 +1,342 @@
+/*
+  Micro-benchmarks for the CPU-bound parts of flash900, so that we can
+  see what the slow MIPS hosts we run on are spending their time on.
+
+  usage: flash900 bench hash [iterations]
+         flash900 bench parse [megabytes]
+         flash900 bench copy [iterations]
+
+  (C) Serval Project Inc. 2014.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include "cintelhex.h"
+#include "flash900.h"
+
+// The original byte-at-a-time checksum loop, kept as the reference that the
+// optimised kernel must agree with.
+static void reference_hash(unsigned char *buffer,int start,int end,
+			   struct flash_hash *h)
+{
+  int i;
+
+  uint32_t hash1=1,hash2=2;
+  uint8_t hibit;
+  uint8_t	j=0;
+  memset(h->checksums,0,sizeof(h->checksums));
+  for(i=start;i<end;i++) {
+    hibit=hash1>>31;
+    hash1 = hash1 << 1;
+    hash1 = hash1 ^ hibit;
+    hash1 = hash1 ^ buffer[i];
+
+    hash2 = hash2 + buffer[i];
+
+    if((i&0x3ff)==0x0) {
+      j++; if ((j<64)) h->checksums[j]=buffer[i];
+      h->checksums[0]++;
+    } else {
+      if ((j<64)) h->checksums[j] += buffer[i];
+    }
+  }
+  for(j=0;j<64;j++) h->checksums[j] &= 0xffff;
+  h->hash1=hash1;
+  h->hash2=hash2;
+}
+
+static void report(char *what,long long elapsed,double bytes)
+{
+  if (elapsed<1) elapsed=1;
+  printf("  %-28s %6lldms  %8.1f MB/sec\n",what,elapsed,
+	 bytes/1048576.0/(elapsed/1000.0));
+}
+
+int bench_hash(int iterations)
+{
+#define BENCH_IMAGES 16
+  unsigned char *images[BENCH_IMAGES];
+  struct flash_hash fast[BENCH_IMAGES],slow;
+  int i,n;
+
+  srandom(900);
+  for(n=0;n<BENCH_IMAGES;n++) {
+    images[n]=malloc(65536);
+    for(i=0;i<65536;i++) images[n][i]=random();
+  }
+
+  // Check both agree before timing anything
+  calculate_hash_batch(images,BENCH_IMAGES,0x400,0xf800,fast);
+  for(n=0;n<BENCH_IMAGES;n++) {
+    reference_hash(images[n],0x400,0xf800,&slow);
+    if (memcmp(&slow,&fast[n],sizeof(slow))) {
+      fprintf(stderr,"ERROR: Checksum kernel disagrees with reference for image %d\n",n);
+      return -1;
+    }
+  }
+
+  double bytes=(double)iterations*BENCH_IMAGES*(0xf800-0x400);
+  printf("Hashing %d x %d images of $%04x bytes:\n",
+	 iterations,BENCH_IMAGES,0xf800-0x400);
+
+  long long t=gettime_ms();
+  for(i=0;i<iterations;i++)
+    for(n=0;n<BENCH_IMAGES;n++)
+      reference_hash(images[n],0x400,0xf800,&slow);
+  report("byte loop",gettime_ms()-t,bytes);
+
+  t=gettime_ms();
+  for(i=0;i<iterations;i++)
+    for(n=0;n<BENCH_IMAGES;n++)
+      calculate_hash_batch(&images[n],1,0x400,0xf800,&fast[n]);
+  report("kernel, one at a time",gettime_ms()-t,bytes);
+
+  t=gettime_ms();
+  for(i=0;i<iterations;i++)
+    calculate_hash_batch(images,BENCH_IMAGES,0x400,0xf800,fast);
+  report("kernel, batched",gettime_ms()-t,bytes);
+
+  for(n=0;n<BENCH_IMAGES;n++) free(images[n]);
+  return 0;
+}
+
+// The original chain-of-comparisons hex digit decoder, for comparison.
+static uint8_t reference_fromhex4(uint8_t i)
+{
+  if      (i >= 0x61 && i <= 0x66) return i - 0x61 + 10;
+  else if (i >= 0x41 && i <= 0x46) return i - 0x41 + 10;
+  else if (i >= 0x30 && i <= 0x39) return i - 0x30;
+  else return 0;
+}
+
+static int append_record(char *out,int type,int address,
+			 unsigned char *data,int len)
+{
+  int i,o=0;
+  unsigned char sum=len+(address>>8)+address+type;
+  o+=sprintf(&out[o],":%02X%04X%02X",len,address&0xffff,type);
+  for(i=0;i<len;i++) {
+    o+=sprintf(&out[o],"%02X",data[i]);
+    sum+=data[i];
+  }
+  o+=sprintf(&out[o],"%02X\r\n",(unsigned char)-sum);
+  return o;
+}
+
+// Synthesise an Intel hex file of up to max_text characters or max_data
+// data bytes, made of the usual 16-byte data records, with extended linear
+// address records every 64KB.
+static char *synthesise_hex(int max_text,int max_data,int *length,
+			    int *data_bytes)
+{
+  char *hex=malloc(max_text+64);
+  int o=0,address=0,i;
+  unsigned char data[16];
+
+  srandom(900);
+  while(o+64<max_text&&address<max_data) {
+    if (!(address&0xffff)) {
+      data[0]=address>>24; data[1]=address>>16;
+      o+=append_record(&hex[o],0x04,0,data,2);
+    }
+    for(i=0;i<16;i++) data[i]=random();
+    o+=append_record(&hex[o],0x00,address,data,16);
+    address+=16;
+  }
+  o+=append_record(&hex[o],0x01,0,data,0);
+  *length=o;
+  *data_bytes=address;
+  return hex;
+}
+
+int bench_parse(int megabytes)
+{
+  int size=megabytes*1048576;
+  int o,address,i;
+  char *hex=synthesise_hex(size,size,&o,&address);
+  printf("Parsing %d bytes of synthetic Intel hex (%d data bytes):\n",o,address);
+
+  // Hex digit decoding alone, over just the record payloads
+  int pairs=address;
+  char *digits=malloc(pairs*2+1);
+  unsigned char *slow=malloc(pairs),*fast=malloc(pairs);
+  for(i=0;i<pairs;i++) sprintf(&digits[i*2],"%02x",(unsigned char)random());
+
+  long long t=gettime_ms();
+  for(i=0;i<pairs;i++)
+    slow[i]=(reference_fromhex4(digits[i*2])<<4)+reference_fromhex4(digits[i*2+1]);
+  report("comparison chain decode",gettime_ms()-t,pairs*2);
+
+  t=gettime_ms();
+  if (ihex_fromhex(fast,(uint8_t *)digits,pairs)!=pairs) {
+    fprintf(stderr,"ERROR: Valid hex digits rejected\n");
+    return -1;
+  }
+  report("table/SIMD decode",gettime_ms()-t,pairs*2);
+  if (memcmp(slow,fast,pairs)) {
+    fprintf(stderr,"ERROR: Hex decoders disagree\n");
+    return -1;
+  }
+
+  // The whole parser
+  t=gettime_ms();
+  ihex_recordset_t *rs=ihex_rs_from_mem(hex,o);
+  report("ihex_rs_from_mem",gettime_ms()-t,o);
+  if (!rs) {
+    fprintf(stderr,"ERROR: Could not parse synthetic hex: %s\n",ihex_error());
+    return -1;
+  }
+  printf("  %d records, %lu data bytes\n",rs->ihrs_count,ihex_rs_get_size(rs));
+
+  ihex_rs_free(rs);
+  free(slow); free(fast); free(digits); free(hex);
+  return 0;
+}
+
+// The original image assembly loop from main.c
+static void reference_assemble(ihex_recordset_t *ihex,unsigned char *buffer)
+{
+  int i,j;
+  for(i=0;i<65536;i++) buffer[i]=0xff;
+  for(i=0;i<ihex->ihrs_count;i++)
+    if (ihex->ihrs_records[i].ihr_type==0x00)
+      for(j=0;j<ihex->ihrs_records[i].ihr_length;j++)
+	buffer[ihex->ihrs_records[i].ihr_address+j]
+	  =ihex->ihrs_records[i].ihr_data[j];
+}
+
+// The original ihex_mem_copy() inner loop: a 32-bit store per word, built a
+// byte at a time.  (The store is done with memcpy() here so that it doesn't
+// fault on hosts that can't do unaligned stores.)
+static void reference_mem_copy(ihex_recordset_t *rs,unsigned char *d,int n,
+			       int w,int big_endian)
+{
+  int i,j,l;
+  memset(d,0,n);
+  for(i=0;i<rs->ihrs_count;i++) {
+    ihex_record_t *x=&rs->ihrs_records[i];
+    if (x->ihr_type!=0x00) continue;
+    for(j=0;j<x->ihr_length;j+=w) {
+      uint32_t v=0;
+      for(l=0;(l<w)&&(j+l<x->ihr_length);l++)
+	v+=x->ihr_data[j+l]<<(8*(big_endian?((w-1)-l):l));
+      memcpy(&d[x->ihr_address+j],&v,4);
+    }
+  }
+}
+
+// How we used to lay out firmware for writing, before the segment map
+static void assemble_ihex(ihex_recordset_t *ihex,unsigned char buffer[65536])
+{
+  // Unprogrammed flash reads as $FF.
+  // Only the first 64KB bank fits in the buffer.  Records are in address
+  // order after ihex_coalesce_records(), so by the time the copy stops at
+  // the first record beyond it, everything below it has been copied.
+  ihex_mem_fill(buffer,65536,0xff);
+  ihex_mem_copy_records(ihex,buffer,65536,IHEX_WIDTH_8BIT,IHEX_ORDER_NATIVE);
+}
+
+int bench_copy(int iterations)
+{
+  int o,address,i;
+  char *hex=synthesise_hex(1<<20,65536,&o,&address);
+  ihex_recordset_t *rs=ihex_rs_from_mem(hex,o);
+  if (!rs) {
+    fprintf(stderr,"ERROR: Could not parse synthetic hex: %s\n",ihex_error());
+    return -1;
+  }
+  unsigned char *slow=malloc(65536+8),*fast=malloc(65536+8);
+
+  // Check both agree before timing anything
+  reference_assemble(rs,slow);
+  assemble_ihex(rs,fast);
+  if (memcmp(slow,fast,65536)) {
+    fprintf(stderr,"ERROR: assemble_ihex() disagrees with reference\n");
+    return -1;
+  }
+  reference_mem_copy(rs,slow,65536,1,0);
+  ihex_mem_copy(rs,fast,65536,IHEX_WIDTH_8BIT,IHEX_ORDER_NATIVE);
+  if (memcmp(slow,fast,65536)) {
+    fprintf(stderr,"ERROR: ihex_mem_copy() disagrees with reference\n");
+    return -1;
+  }
+#if !defined(__BYTE_ORDER__) || (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  reference_mem_copy(rs,slow,65536,4,1);
+  ihex_mem_copy(rs,fast,65536,IHEX_WIDTH_32BIT,IHEX_ORDER_BIGENDIAN);
+  if (memcmp(slow,fast,65536)) {
+    fprintf(stderr,"ERROR: ihex_mem_copy() disagrees with reference for big-endian words\n");
+    return -1;
+  }
+#endif
+
+  double bytes=(double)iterations*address;
+  printf("Copying %d x %d records (%d data bytes) into a 64KB image:\n",
+	 iterations,rs->ihrs_count,address);
+
+  long long t=gettime_ms();
+  for(i=0;i<iterations;i++) reference_assemble(rs,slow);
+  report("byte loop assemble",gettime_ms()-t,bytes);
+
+  t=gettime_ms();
+  for(i=0;i<iterations;i++) assemble_ihex(rs,fast);
+  report("assemble_ihex",gettime_ms()-t,bytes);
+
+  t=gettime_ms();
+  for(i=0;i<iterations;i++) reference_mem_copy(rs,slow,65536,1,0);
+  report("old ihex_mem_copy, 8-bit",gettime_ms()-t,bytes);
+
+  t=gettime_ms();
+  for(i=0;i<iterations;i++)
+    ihex_mem_copy(rs,fast,65536,IHEX_WIDTH_8BIT,IHEX_ORDER_NATIVE);
+  report("ihex_mem_copy, 8-bit",gettime_ms()-t,bytes);
+
+  t=gettime_ms();
+  for(i=0;i<iterations;i++) reference_mem_copy(rs,slow,65536,4,1);
+  report("old ihex_mem_copy, 32-bit BE",gettime_ms()-t,bytes);
+
+  t=gettime_ms();
+  for(i=0;i<iterations;i++)
+    ihex_mem_copy(rs,fast,65536,IHEX_WIDTH_32BIT,IHEX_ORDER_BIGENDIAN);
+  report("ihex_mem_copy, 32-bit BE",gettime_ms()-t,bytes);
+
+  ihex_rs_free(rs);
+  free(slow); free(fast); free(hex);
+  return 0;
+}
+
+int run_benchmarks(int argc,char **argv)
+{
+  if (argc<3) {
+    usage();
+    return -1;
+  }
+  int iterations=argc>3?atoi(argv[3]):0;
+
+  if (!strcasecmp(argv[2],"hash"))
+    return bench_hash(iterations>0?iterations:100);
+  if (!strcasecmp(argv[2],"parse"))
+    return bench_parse(iterations>0?iterations:8);
+  if (!strcasecmp(argv[2],"copy"))
+    return bench_copy(iterations>0?iterations:1000);
+
+  usage();
+  return -1;
+}
@@ -0,0 +1,467 @@
+/*
+  Firmware bundles: every variant of the firmware in one small file.
+
+  We ship one firmware build per board id and frequency id, and they
+  differ from one another in only a few hundred bytes (mostly frequency
+  tables and version strings).  Storing each one in full wastes the
+  small flash of the Mesh Extender, and makes OTA updates much larger
+  than they need to be.  So "flash900 bundle <base>" takes all of the
+  firmware found for <base>, and writes <base>.bundle, which holds one
+  compressed base image, plus for each variant its segment table and
+  the runs of bytes in which it differs from the base, also compressed.
+
+  Getting a variant back means inflating the base and its (tiny) delta,
+  and patching the runs in, which takes well under a millisecond.  The
+  !F checksums of each variant are stored in the clear, so that checking
+  whether a radio is up to date needs nothing inflated at all.
+
+  File layout (all fields little-endian):
+
+    0x000  "RFD900BN"
+    0x008  format version (1)
+    0x00C  number of variants
+    0x010  image size in bytes (image starts at flash address 0)
+    0x014  offset and length of base image (raw deflate)
+    0x01C  offset of variant directory, which has for each variant:
+           0x00  board id, frequency id, 2 bytes reserved
+           0x04  number of segments
+           0x08  offset, compressed length and inflated length of delta
+           0x14  hash1, hash2 and 64 checksums, as per calculate_hash_batch()
+                 over $0400-$F7FF
+    then   base image, then each delta (raw deflate), which inflate to
+           the segment table (start address and length of each run of
+           data), followed by patches: address, length and the bytes to
+           put there, until the end of the delta.
+
+  Only the bytes covered by a variant's segments matter, so patches
+  need only cover those.
+
+  (C) Serval Project Inc. 2014.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+// miniz itself is compiled in eeprom.c
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_ARCHIVE_WRITING_APIS
+#define MINIZ_HEADER_FILE_ONLY
+#include "miniz.c"
+#include "cintelhex.h"
+#include "flash900.h"
+
+#define BUNDLE_MAGIC "RFD900BN"
+#define BUNDLE_VERSION 1
+#define BUNDLE_HEADER_SIZE 0x20
+#define BUNDLE_ENTRY_SIZE (0x14+4*(2+64))
+// Patches cost 8 bytes of header, so join runs separated by fewer than
+// that many matching bytes.
+#define BUNDLE_PATCH_JOIN 8
+
+struct bundle_file {
+  unsigned char *map;
+  size_t size;
+  uint32_t variants,image_size,base_offset,base_length,directory;
+};
+
+static int bundle_open(char *filename,struct bundle_file *b)
+{
+  int fd=open(filename,O_RDONLY);
+  if (fd==-1) return -1;
+
+  struct stat st;
+  b->map=MAP_FAILED;
+  if (!fstat(fd,&st)&&(st.st_size>=BUNDLE_HEADER_SIZE))
+    b->map=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if (b->map==MAP_FAILED) {
+    fprintf(stderr,"Could not map firmware bundle '%s'\n",filename);
+    return -1;
+  }
+  b->size=st.st_size;
+
+  b->variants=get32(&b->map[0x0C]);
+  b->image_size=get32(&b->map[0x10]);
+  b->base_offset=get32(&b->map[0x14]);
+  b->base_length=get32(&b->map[0x18]);
+  b->directory=get32(&b->map[0x1C]);
+  char *problem=NULL;
+  if (memcmp(b->map,BUNDLE_MAGIC,8)) problem="not a firmware bundle";
+  else if (get32(&b->map[0x08])!=BUNDLE_VERSION) problem="unsupported version";
+  else if ((b->image_size<0xf800)||(b->image_size>FLASH_SIZE_MAX)
+	   ||(b->variants>256)
+	   ||(b->directory+(unsigned long long)BUNDLE_ENTRY_SIZE*b->variants
+	      >b->size)
+	   ||(b->base_offset+(unsigned long long)b->base_length>b->size))
+    problem="truncated or corrupt";
+  if (problem) {
+    fprintf(stderr,"Firmware bundle '%s' is %s\n",filename,problem);
+    munmap(b->map,b->size);
+    return -1;
+  }
+  return 0;
+}
+
+static void bundle_entry_hash(unsigned char *entry,struct flash_hash *hash)
+{
+  int i;
+  hash->hash1=get32(&entry[0x14]);
+  hash->hash2=get32(&entry[0x18]);
+  for(i=0;i<64;i++) hash->checksums[i]=get32(&entry[0x1C+i*4]);
+}
+
+int bundle_entries(char *filename,struct firmware_entry *entries,int max)
+{
+  struct bundle_file b;
+  struct stat st;
+  if (stat(filename,&st)||bundle_open(filename,&b)) return -1;
+
+  int i,count=0;
+  for(i=0;(i<b.variants)&&(count<max);i++) {
+    unsigned char *entry=&b.map[b.directory+i*BUNDLE_ENTRY_SIZE];
+    struct firmware_entry *e=&entries[count++];
+    e->id=entry[0]; e->freq=entry[1];
+    e->format=FIRMWARE_BUNDLE;
+    e->mtime=st.st_mtime; e->size=st.st_size;
+    bundle_entry_hash(entry,&e->hash);
+    e->have_hash=1;
+    snprintf(e->path,sizeof(e->path),"%s",filename);
+  }
+  munmap(b.map,b.size);
+  return count;
+}
+
+ihex_recordset_t *bundle_load(char *filename,int id,int freq,
+			      unsigned char **image,struct flash_hash *hash)
+{
+  struct bundle_file b;
+  if (bundle_open(filename,&b)) return NULL;
+
+  unsigned char *entry=NULL;
+  int i;
+  for(i=0;i<b.variants;i++) {
+    unsigned char *e=&b.map[b.directory+i*BUNDLE_ENTRY_SIZE];
+    if ((e[0]==id)&&(e[1]==freq)) { entry=e; break; }
+  }
+
+  char *problem=NULL;
+  unsigned char *data=NULL,*delta=NULL;
+  ihex_recordset_t *ihex=NULL;
+  uint32_t segments=0,delta_offset=0,delta_length=0,delta_size=0;
+  if (!entry) problem="missing this radio";
+  else {
+    segments=get32(&entry[0x04]);
+    delta_offset=get32(&entry[0x08]);
+    delta_length=get32(&entry[0x0C]);
+    delta_size=get32(&entry[0x10]);
+    if ((delta_offset+(unsigned long long)delta_length>b.size)
+	||(delta_size>8*b.image_size)||(segments>delta_size/8))
+      problem="truncated or corrupt";
+  }
+  if (!problem) {
+    data=malloc(b.image_size);
+    delta=malloc(delta_size+1);
+    if (!data||!delta) problem="too big to fit in memory";
+  }
+  if ((!problem)
+      &&((tinfl_decompress_mem_to_mem(data,b.image_size,
+				      &b.map[b.base_offset],b.base_length,0)
+	  !=b.image_size)
+	 ||(tinfl_decompress_mem_to_mem(delta,delta_size,
+					&b.map[delta_offset],delta_length,0)
+	    !=delta_size)))
+    problem="corrupt (does not inflate)";
+
+  // Check the segment table, then apply the patches
+  for(i=0;(!problem)&&(i<segments);i++) {
+    uint32_t start=get32(&delta[i*8]);
+    uint32_t length=get32(&delta[i*8+4]);
+    if ((start>b.image_size)||(length>b.image_size-start))
+      problem="segment out of range";
+  }
+  uint32_t o=8*segments;
+  while((!problem)&&(o<delta_size)) {
+    if (delta_size-o<8) { problem="truncated or corrupt"; break; }
+    uint32_t address=get32(&delta[o]);
+    uint32_t length=get32(&delta[o+4]);
+    o+=8;
+    if ((address>b.image_size)||(length>b.image_size-address)
+	||(length>delta_size-o))
+      problem="patch out of range";
+    else memcpy(&data[address],&delta[o],length);
+    o+=length;
+  }
+
+  if (!problem) {
+    ihex=fwimage_records(delta,segments,data);
+    if (!ihex) problem="too big to fit in memory";
+  }
+  if (problem) {
+    fprintf(stderr,"Firmware bundle '%s' is %s\n",filename,problem);
+    free(data);
+  } else {
+    ihex->ihrs_arena=data;
+    if (image) *image=data;
+    if (hash) bundle_entry_hash(entry,hash);
+  }
+  free(delta);
+  munmap(b.map,b.size);
+  return ihex;
+}
+
+struct bundle_variant {
+  struct firmware_entry *entry;
+  ihex_recordset_t *ihex;
+  struct segment_map *map;
+  unsigned char *image;
+  unsigned char *delta;
+  size_t delta_size,delta_length;
+  void *compressed;
+};
+
+// Number of bytes of v's firmware that differ in image
+static unsigned int variant_cost(struct bundle_variant *v,unsigned char *image)
+{
+  unsigned int cost=0,a;
+  int i;
+  for(i=0;i<v->map->count;i++)
+    for(a=v->map->segments[i].start;a<v->map->segments[i].end;a++)
+      if (v->image[a]!=image[a]) cost++;
+  return cost;
+}
+
+// Segment table of v, followed by patches that turn base into v
+static int variant_delta(struct bundle_variant *v,unsigned char *base)
+{
+  struct segment_map *map=v->map;
+  int i;
+  size_t space=8*map->count;
+  for(i=0;i<map->count;i++)
+    space+=8+(map->segments[i].end-map->segments[i].start);
+  v->delta=malloc(space);
+  if (!v->delta) return -1;
+
+  size_t o=0;
+  for(i=0;i<map->count;i++) {
+    put32(&v->delta[o],map->segments[i].start);
+    put32(&v->delta[o+4],map->segments[i].end-map->segments[i].start);
+    o+=8;
+  }
+  for(i=0;i<map->count;i++) {
+    unsigned int a=map->segments[i].start,end=map->segments[i].end;
+    while(a<end) {
+      if (v->image[a]==base[a]) { a++; continue; }
+      // Extend the patch until we reach enough matching bytes in a row
+      unsigned int patch_end=a+1,same=0;
+      while((patch_end+same<end)&&(same<BUNDLE_PATCH_JOIN)) {
+	if (v->image[patch_end+same]==base[patch_end+same]) same++;
+	else { patch_end+=same+1; same=0; }
+      }
+      put32(&v->delta[o],a);
+      put32(&v->delta[o+4],patch_end-a);
+      memcpy(&v->delta[o+8],&v->image[a],patch_end-a);
+      o+=8+patch_end-a;
+      a=patch_end;
+    }
+  }
+  v->delta_size=o;
+  return 0;
+}
+
+int bundle_build(char *base)
+{
+  if (firmware_index_build(base)<=0) {
+    fprintf(stderr,"Could not find any firmware for '%s'\n",base);
+    return -1;
+  }
+
+  // Load and assemble the preferred file for every variant
+  int count=0,i,j,fail=0;
+  uint32_t image_size=65536;
+  long long original_size=0;
+  struct bundle_variant *variants=calloc(firmware_index_count,
+					 sizeof(struct bundle_variant));
+  for(i=0;i<firmware_index_count;i++)
+    if (firmware_entry_preferred(&firmware_index[i]))
+      variants[count++].entry=&firmware_index[i];
+  for(i=0;(!fail)&&(i<count);i++) {
+    struct bundle_variant *v=&variants[i];
+    v->ihex=firmware_entry_load(v->entry);
+    if (v->ihex) v->map=segmap_from_ihex(v->ihex);
+    if (!v->map) {
+      fprintf(stderr,"Could not read firmware from '%s'\n",v->entry->path);
+      fail=-1;
+      break;
+    }
+    if (v->map->count&&(v->map->segments[v->map->count-1].end>FLASH_SIZE_MAX)) {
+      fprintf(stderr,"'%s' contains data beyond the end of flash\n",
+	      v->entry->path);
+      fail=-1;
+      break;
+    }
+    v->image=malloc(FLASH_SIZE_MAX);
+    segmap_assemble(v->map,v->image,0,FLASH_SIZE_MAX,0xff);
+    if (v->map->count)
+      while(v->map->segments[v->map->count-1].end>image_size) image_size*=2;
+    if (!v->entry->have_hash) {
+      calculate_hash_segments(v->map,0x400,0xf800,&v->entry->hash);
+      v->entry->have_hash=1;
+    }
+    if (v->entry->format!=FIRMWARE_BUNDLE) original_size+=v->entry->size;
+  }
+
+  // Use as the base whichever variant the others differ least from
+  int best=0;
+  unsigned int best_cost=0xffffffff;
+  for(i=0;(!fail)&&(i<count);i++) {
+    unsigned int cost=0;
+    for(j=0;j<count;j++)
+      if (j!=i) cost+=variant_cost(&variants[j],variants[i].image);
+    if (cost<best_cost) { best=i; best_cost=cost; }
+  }
+
+  size_t base_length=0;
+  void *base_compressed=NULL;
+  if (!fail) {
+    base_compressed=tdefl_compress_mem_to_heap(variants[best].image,image_size,
+					       &base_length,
+					       TDEFL_DEFAULT_MAX_PROBES);
+    if (!base_compressed) fail=-1;
+  }
+  for(i=0;(!fail)&&(i<count);i++) {
+    struct bundle_variant *v=&variants[i];
+    if (variant_delta(v,variants[best].image)) { fail=-1; break; }
+    v->compressed=tdefl_compress_mem_to_heap(v->delta,v->delta_size,
+					     &v->delta_length,
+					     TDEFL_DEFAULT_MAX_PROBES);
+    if (!v->compressed) fail=-1;
+  }
+
+  // Write it all out, and then make sure that we can get every variant
+  // back, and quickly enough.
+  char filename[1024],tempname[1024];
+  snprintf(filename,1024,"%s.bundle",base);
+  snprintf(tempname,1024,"%s.bundle.new",base);
+  FILE *f=NULL;
+  if (!fail) {
+    f=fopen(tempname,"w");
+    if (!f) {
+      fprintf(stderr,"Could not create '%s'\n",tempname);
+      fail=-1;
+    }
+  }
+  if (!fail) {
+    unsigned char header[BUNDLE_HEADER_SIZE];
+    unsigned char *directory=calloc(count,BUNDLE_ENTRY_SIZE);
+    uint32_t offset=BUNDLE_HEADER_SIZE+BUNDLE_ENTRY_SIZE*count;
+    memset(header,0,sizeof(header));
+    memcpy(header,BUNDLE_MAGIC,8);
+    put32(&header[0x08],BUNDLE_VERSION);
+    put32(&header[0x0C],count);
+    put32(&header[0x10],image_size);
+    put32(&header[0x14],offset);
+    put32(&header[0x18],base_length);
+    put32(&header[0x1C],BUNDLE_HEADER_SIZE);
+    offset+=base_length;
+    for(i=0;i<count;i++) {
+      struct bundle_variant *v=&variants[i];
+      unsigned char *entry=&directory[i*BUNDLE_ENTRY_SIZE];
+      entry[0]=v->entry->id; entry[1]=v->entry->freq;
+      put32(&entry[0x04],v->map->count);
+      put32(&entry[0x08],offset);
+      put32(&entry[0x0C],v->delta_length);
+      put32(&entry[0x10],v->delta_size);
+      put32(&entry[0x14],v->entry->hash.hash1);
+      put32(&entry[0x18],v->entry->hash.hash2);
+      for(j=0;j<64;j++) put32(&entry[0x1C+j*4],v->entry->hash.checksums[j]);
+      offset+=v->delta_length;
+    }
+    if ((fwrite(header,sizeof(header),1,f)!=1)
+	||(fwrite(directory,BUNDLE_ENTRY_SIZE,count,f)!=count)
+	||(fwrite(base_compressed,base_length,1,f)!=1))
+      fail=-1;
+    for(i=0;(!fail)&&(i<count);i++)
+      if (fwrite(variants[i].compressed,variants[i].delta_length,1,f)!=1)
+	fail=-1;
+    if (fclose(f)) fail=-1;
+    if (fail) fprintf(stderr,"Could not write '%s'\n",tempname);
+    free(directory);
+  }
+
+  long long slowest=0;
+  for(i=0;(!fail)&&(i<count);i++) {
+    struct bundle_variant *v=&variants[i];
+    long long start_time=gettime_ms();
+    ihex_recordset_t *ihex=bundle_load(tempname,v->entry->id,v->entry->freq,
+				       NULL,NULL);
+    struct segment_map *map=ihex?segmap_from_ihex(ihex):NULL;
+    long long load_time=gettime_ms()-start_time;
+    if (load_time>slowest) slowest=load_time;
+    struct flash_range range;
+    if ((!map)||(map->count!=v->map->count)
+	||segmap_diff(map,v->map,&range,1,0)) {
+      fprintf(stderr,"Firmware for board id = $%02x, freq = $%02x does not survive bundling\n",
+	      v->entry->id,v->entry->freq);
+      fail=-1;
+    }
+    segmap_free(map);
+    ihex_rs_free(ihex);
+  }
+
+  if (!fail) {
+    if (rename(tempname,filename)) {
+      fprintf(stderr,"Could not replace '%s'\n",filename);
+      fail=-1;
+    } else {
+      struct stat st;
+      stat(filename,&st);
+      printf("Bundled %d variants (base is board id = $%02x, freq = $%02x) into '%s'\n",
+	     count,variants[best].entry->id,variants[best].entry->freq,filename);
+      printf("%lld bytes",(long long)st.st_size);
+      if (original_size) printf(", vs %lld bytes of separate files",original_size);
+      printf(". Slowest variant took %lldms to load.\n",slowest);
+    }
+  } else unlink(tempname);
+
+  for(i=0;i<count;i++) {
+    struct bundle_variant *v=&variants[i];
+    segmap_free(v->map);
+    ihex_rs_free(v->ihex);
+    free(v->image);
+    free(v->delta);
+    mz_free(v->compressed);
+  }
+  mz_free(base_compressed);
+  free(variants);
+  return fail;
+}
+
+int bundle_main(int argc,char **argv)
+{
+  // flash900 bundle <firmware base>
+  if (argc!=3) {
+    usage();
+    return -1;
+  }
+  return bundle_build(argv[2]);
+}
@@ -85,12 +85,32 @@ typedef struct ihex_record {
 /** This structure models an entire set of Intel HEX record, i.e. a
  *  complete Intel HEX input file. Basically, it just consists of a list
  *  of ihex_record_t structures.
- *  The last record must be a special EOF record. */
+ *  The last record must be a special EOF record.
+ *  If ihrs_arena is set, the data of all records is stored in that one
+ *  block, and records do not own their ihr_data. If ihrs_mapped is also
+ *  set, the arena is a read-only memory mapping of that many bytes. */
 typedef struct ihex_recordset {
 	uint_t         ihrs_count;   //!< Amount of records.
 	ihex_record_t *ihrs_records; //!< A list of record (with ihrs_count elements).
+	ihex_rdata_t   ihrs_arena;   //!< Shared record data storage, or NULL.
+	size_t         ihrs_mapped;  //!< Size of the arena if it is mapped, else 0.
 } ihex_recordset_t;
 
+/// Models an Intel HEX input that arrives a piece at a time.
+/** Records are appended to ihs_rs as soon as each line is complete, so
+ *  that the caller can act on them while the rest is still arriving.
+ *  Only ever refer to records by index, as the record array may move
+ *  when it grows. */
+#define IHEX_STREAM_LINE_MAX 1024
+typedef struct ihex_stream {
+	ihex_recordset_t *ihs_rs;       //!< Records received so far.
+	uint_t            ihs_capacity; //!< Allocated size of the record array.
+	uint_t            ihs_line_no;  //!< Number of complete lines so far.
+	int               ihs_eof;      //!< Set once the EOF record is seen.
+	uint_t            ihs_line_len; //!< Length of the partial line.
+	char              ihs_line[IHEX_STREAM_LINE_MAX]; //!< The partial line.
+} ihex_stream_t;
+
 // GLOBAL VARIABLES
 
 #ifdef IHEX_PARSE_C
@@ -131,6 +151,32 @@ ihex_recordset_t* ihex_rs_from_mem(const char* data, size_t size);
  *  @return         A pointer to a newly generated recordset object. */
 ihex_recordset_t* ihex_rs_from_string(const char* data);
 
+/// Start parsing Intel HEX input incrementally.
+/** This method returns a new stream, to which input can be passed in
+ *  pieces of any size using ihex_stream_feed().
+ * 
+ *  @return A pointer to a newly generated stream object. */
+ihex_stream_t* ihex_stream_new(void);
+
+/// Parse more Intel HEX input.
+/** This method parses a further piece of input, appending every record
+ *  that is completed by it to the stream's record set.
+ * 
+ *  @param s    The stream.
+ *  @param data The input start address.
+ *  @param size The input size in bytes.
+ *  @return     0 on success, an error code otherwise. */
+int ihex_stream_feed(ihex_stream_t* s, const char* data, size_t size);
+
+/// Finish parsing Intel HEX input.
+/** This method frees the stream and returns the record set that was
+ *  parsed, or NULL if the input was incomplete. The record set must be
+ *  freed with ihex_rs_free().
+ * 
+ *  @param s The stream.
+ *  @return  A pointer to the complete record set. */
+ihex_recordset_t* ihex_stream_finish(ihex_stream_t* s);
+
 /// Gets a record set's size.
 /** This method determines a record set's size. This is done by adding
  *  the length of all records, however without regard to address offsets
@@ -148,6 +194,13 @@ ulong_t ihex_rs_get_size(ihex_recordset_t* rs);
  *  @param rs A pointer to the record set. */
 void ihex_rs_free(ihex_recordset_t* rs);
 
+/// Frees the data of the records in a record set.
+/** This method frees the record data, but not the records themselves,
+ *  however it is stored.
+ * 
+ *  @param rs A pointer to the record set. */
+void ihex_rs_free_data(ihex_recordset_t* rs);
+
 /// Return error code, or 0 if no error occurred.
 /** This method returns the error code of the latest error.
  *  @return The error code of the latest error. */
@@ -174,6 +227,20 @@ int ihex_check_record(ihex_record_t *r);
  *  @return    0 on success, an error code otherwise. */
 int ihex_mem_copy(ihex_recordset_t *rs, void* dst, ulong_t n, ihex_width_t w, ihex_byteorder_t o);
 
+/// Copy the content of a record set over existing memory.
+/** This method works like ihex_mem_copy(), but leaves the bytes that no
+ *  record covers as they were, so that the target can be prefilled,
+ *  e.g. with the erased state of flash memory. Records are copied with
+ *  memcpy() where no byte swapping is needed.
+ * 
+ *  @param rs  The record set that is to be copied.
+ *  @param dst A pointer to the destination address.
+ *  @param n   The size of the allocated target area.
+ *  @param w   The width of data words to be copied.
+ *  @param o   Defines whether data words are big or little endian.
+ *  @return    0 on success, an error code otherwise. */
+int ihex_mem_copy_records(ihex_recordset_t *rs, void* dst, ulong_t n, ihex_width_t w, ihex_byteorder_t o);
+
 /// Fill a memory area with zeroes.
 /** This method fills a whole memory area with zeros.
  * 
@@ -182,6 +249,15 @@ int ihex_mem_copy(ihex_recordset_t *rs, void* dst, ulong_t n, ihex_width_t w, ih
  *  @return    0 on success, an error code otherwise. */
 int ihex_mem_zero(void* dst, ulong_t n);
 
+/// Fill a memory area with a byte value.
+/** This method fills a whole memory area with the given value.
+ * 
+ *  @param dst   Target area.
+ *  @param n     The size of the target area.
+ *  @param value The byte to fill it with.
+ *  @return      0 on success, an error code otherwise. */
+int ihex_mem_fill(void* dst, ulong_t n, uint8_t value);
+
 /// Return error string, or NULL if no error occurred.
 char* ihex_error(void);
 
@@ -191,8 +267,29 @@ uint8_t ihex_fromhex8(uint8_t *input);
 /// Parse 16-bit hex input.
 uint16_t ihex_fromhex16(uint8_t *input);
 
-// Merge records
-void ihex_aggregate_records(ihex_recordset_t *ihex);
+/// Decode a run of hex digit pairs.
+/** This method decodes n bytes from 2*n hex digits. Unlike
+ *  ihex_fromhex8(), invalid digits are reported rather than being
+ *  decoded as zero.
+ * 
+ *  @param out Target area for n bytes.
+ *  @param in  The 2*n input characters.
+ *  @param n   The number of bytes to decode.
+ *  @return    n on success, otherwise the index of the first byte with
+ *             an invalid digit. */
+uint_t ihex_fromhex(uint8_t *out, const uint8_t *in, uint_t n);
+
+/// Sort and coalesce the records of a record set.
+/** This method replaces the records of a record set with one data
+ *  record for each contiguous run of data, in ascending address order,
+ *  regardless of the order of the input. Where records overlap, the one
+ *  that came later in the input wins. ELA records are emitted wherever
+ *  a run starts in a new 64KB bank, and the set ends in an EOF record.
+ *  All record data ends up in a single newly allocated arena.
+ * 
+ *  @param ihex The record set to coalesce.
+ *  @return     0 on success, an error code otherwise. */
+int ihex_coalesce_records(ihex_recordset_t *ihex);
   
 #ifdef __cplusplus
 } // extern "C"
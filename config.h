@@ -1 +1,5 @@
-/* Empty file */
+/* Build configuration for the bundled libcintelhex. */
+
+#define HAVE_MMAP 1
+#define HAVE_SYS_MMAN_H 1
+#define HAVE_MEMSET 1
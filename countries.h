@@ -0,0 +1,11 @@
+struct country {
+  char *country;
+  char *iso3166_code;
+};
+
+struct country countries[]={
+  {"Australia","AU"},
+  {"New Zealand","NZ"},
+  {"United States","US"},
+{NULL,NULL}
+};
@@ -5,6 +5,8 @@
 #include <strings.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 #include "flash900.h"
 #include "sha3.h"
 
@@ -32,6 +34,7 @@ unsigned long configuration_directives_length=strlen("nodirectives=true\n");
 #include "miniz.c"
 
 int eeprom_write_page(int fd, int address,unsigned char *readblock);
+int eeprom_negotiate_frames(int fd);
 
 struct directive {
   char *key;
@@ -137,8 +140,375 @@ int directive_set_value(char *directive_key,char *directive_value)
   return 0;
 }
 
+// Changes to make to the directives, which we make all in one go, so that
+// we read, write and verify the EEPROM only once for all of them.
+#define DIRECTIVE_SET 1
+#define DIRECTIVE_CLEAR 2
+struct directive_op {
+  int op;
+  char *key;
+  char *value;  // "" to delete
+};
+struct directive_op directive_ops[MAX_DIRECTIVES];
+int directive_op_count=0;
+
+int directive_op_add(int op,char *key,char *value)
+{
+  if (directive_op_count>=MAX_DIRECTIVES) {
+    fprintf(stderr,"Too many directive changes (limit = %d)\n",MAX_DIRECTIVES);
+    return -1;
+  }
+  directive_ops[directive_op_count].op=op;
+  directive_ops[directive_op_count].key=key;
+  directive_ops[directive_op_count++].value=value;
+  return 0;
+}
+
+// Parse "set <key> <value>", "del <key>" and "clear" from words
+int directive_ops_parse(char **words,int count)
+{
+  int i=0,result=0;
+  while((i<count)&&(!result)) {
+    if ((!strcasecmp(words[i],"set"))&&(i+2<count)) {
+      result=directive_op_add(DIRECTIVE_SET,words[i+1],words[i+2]);
+      i+=3;
+    } else if ((!strcasecmp(words[i],"del"))&&(i+1<count)) {
+      result=directive_op_add(DIRECTIVE_SET,words[i+1],"");
+      i+=2;
+    } else if (!strcasecmp(words[i],"clear")) {
+      result=directive_op_add(DIRECTIVE_CLEAR,NULL,NULL);
+      i++;
+    } else return -1;
+  }
+  return result;
+}
+
+// The same, one per line, from a file, or stdin if filename is "-".  The
+// value is the rest of the line, so may contain spaces.  Blank lines and
+// lines starting with # are ignored.
+int directive_ops_from_file(char *filename)
+{
+  FILE *f=strcmp(filename,"-")?fopen(filename,"r"):stdin;
+  if (!f) {
+    fprintf(stderr,"Could not open '%s'\n",filename);
+    return -1;
+  }
+  char line[1024];
+  int line_number=0,result=0;
+  while((!result)&&fgets(line,sizeof(line),f)) {
+    line_number++;
+    int len=strlen(line);
+    while(len&&((line[len-1]=='\n')||(line[len-1]=='\r'))) line[--len]=0;
+    char op[1024],key[1024];
+    int value_offset=0;
+    if ((!line[0])||(line[0]=='#')) continue;
+    int words=sscanf(line,"%s %s %n",op,key,&value_offset);
+    char *argv[3]={op,key,value_offset?&line[value_offset]:""};
+    if (words<1) continue;
+    // "set KEY" with nothing after it would quietly delete KEY, so a value
+    // is required; use "del KEY" for that.
+    if (((!strcasecmp(op,"set"))&&((words!=2)||(!argv[2][0])))
+	||((!strcasecmp(op,"del"))&&((words!=2)||argv[2][0]))) {
+      fprintf(stderr,"%s:%d: Could not parse '%s'\n",filename,line_number,line);
+      result=-1;
+      break;
+    }
+    if (words>=2) argv[1]=strdup(key);
+    if (!strcasecmp(op,"set")) argv[2]=strdup(argv[2]);
+    result=directive_ops_parse(argv,!strcasecmp(op,"set")?3:words);
+    if (result)
+      fprintf(stderr,"%s:%d: Could not parse '%s'\n",filename,line_number,line);
+  }
+  if (f!=stdin) fclose(f);
+  return result;
+}
+
+// Make all the changes to the list from directives_to_list()
+int directive_ops_apply()
+{
+  for(int i=0;i<directive_op_count;i++) {
+    if (directive_ops[i].op==DIRECTIVE_CLEAR) {
+      configuration_directives[0]=0;
+      directives_to_list();
+    } else
+      directive_set_value(directive_ops[i].key,directive_ops[i].value);
+  }
+  return 0;
+}
+
 #define READ_ALL 1
 #define DIRECTIVES_ONLY 2
+
+// The EEPROM holds three independently hashed regions, each of which we
+// read, build, write and verify on its own, so that changing one leaves
+// the others (and their hashes) alone.
+#define EEPROM_DIRECTIVES 1
+#define EEPROM_REGULATORY 2
+#define EEPROM_PARAMETERS 4
+#define EEPROM_ALL_REGIONS 7
+#define EEPROM_REGIONS 3
+struct eeprom_region {
+  int start;   // first byte
+  int hash;    // 16 byte hash of start - hash, at the end of the region
+  int end;
+} eeprom_regions[EEPROM_REGIONS]={
+  {0x000,0x3F0,0x400},  // Mesh Extender configuration directives
+  {0x400,0x7B0,0x7C0},  // Regulatory information text
+  {0x7C0,0x7F0,0x800}   // Radio parameters
+};
+
+// Format byte at $7EF, which says how the directives and regulatory text
+// are compressed:
+//   $01 - zlib streams
+//   $02 - raw deflate streams, primed with the preset dictionaries below
+#define EEPROM_FORMAT_ZLIB 0x01
+#define EEPROM_FORMAT_PRESET 0x02
+#define EEPROM_FORMAT_CURRENT EEPROM_FORMAT_PRESET
+
+// The text is short, and much of it is always the same, which deflate can
+// only make use of the second time it sees it.  So we compress as though
+// each block followed a dictionary of the text it usually contains, with
+// the commonest last, as nearer matches code shorter.  These are part of
+// format $02, and so must never change: a new dictionary needs a new
+// format byte.
+static const char eeprom_directives_dictionary[]=
+  "nodirectives=true\n"
+  "LATITUDE=-LONGITUDE=+"
+  "MESHEXTENDERNAME="
+  "OTABID=";
+static const char eeprom_regulatory_dictionary[]=
+  "<p class=warning>This Mesh Extender has been configured with the intention of"
+  " operation in the following locations.  Note that this does not"
+  " constitute a legal opinion, indeminification or anything similar,"
+  " and all operation and use of this Mesh Extender is the"
+  " responsibility of its operator.\n\n"
+  "<p class=locationlistheading>The list of locations follows, and in alphabetical order, and using the conventions of ISO3166:\n\n"
+  "<table class=locationlisttable>\n"
+  "</table>\n\n"
+  "<p class=radioparameters>The radio is configured to operate at 0 Hz, with a transmit power of 0 dBm, and a maximum duty cycle of 100 %.\n"
+  "<tr class=locationlistrow><td></td><td></td></tr>\n"
+  "<tr class=locationlistrow><td>";
+
+static const char *eeprom_dictionary(int format,int region)
+{
+  if (format!=EEPROM_FORMAT_PRESET) return "";
+  return region?eeprom_regulatory_dictionary:eeprom_directives_dictionary;
+}
+
+// Inflate a text region.  With more set, in is only the start of a stream,
+// which must end at a block boundary, and we return the text it holds.
+// Otherwise, we return in *in_len how long the stream is.
+static int eeprom_inflate(int format,int region,unsigned char *in,
+			  unsigned long *in_len,char *text,
+			  unsigned long *text_len,int more)
+{
+  if ((format!=EEPROM_FORMAT_ZLIB)&&(format!=EEPROM_FORMAT_PRESET))
+    return MZ_DATA_ERROR;
+
+  // Inflate after the dictionary, so that it is there to be referred to
+  const char *dictionary=eeprom_dictionary(format,region);
+  int dictionary_len=strlen(dictionary);
+  unsigned char *buffer=malloc(dictionary_len+*text_len);
+  tinfl_decompressor *inflator=malloc(sizeof(tinfl_decompressor));
+  if ((!buffer)||(!inflator)) { free(buffer); free(inflator); return MZ_MEM_ERROR; }
+  memcpy(buffer,dictionary,dictionary_len);
+  tinfl_init(inflator);
+  size_t in_bytes=*in_len,out_bytes=*text_len;
+  tinfl_status status=
+    tinfl_decompress(inflator,in,&in_bytes,buffer,&buffer[dictionary_len],
+		     &out_bytes,TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF
+		     |(format==EEPROM_FORMAT_ZLIB?TINFL_FLAG_PARSE_ZLIB_HEADER:0)
+		     |(more?TINFL_FLAG_HAS_MORE_INPUT:0));
+  int ok=more?((status==TINFL_STATUS_NEEDS_MORE_INPUT)&&(in_bytes==*in_len))
+    :(status==TINFL_STATUS_DONE);
+  if (ok) {
+    memcpy(text,&buffer[dictionary_len],out_bytes);
+    *text_len=out_bytes;
+    *in_len=in_bytes;
+  }
+  free(inflator);
+  free(buffer);
+  return ok?MZ_OK:MZ_DATA_ERROR;
+}
+
+int eeprom_uncompress(int format,int region,unsigned char *in,
+		      unsigned long in_len,char *text,unsigned long *text_len)
+{
+  return eeprom_inflate(format,region,in,&in_len,text,text_len,0);
+}
+
+// Deflate text from offset from onwards, to follow the first at bytes of
+// out, which must be a stream that decodes to the text before from, and
+// ends at a block boundary.  In the directives, we sync flush at the end
+// of a line, so that a later change can keep the stream up to about where
+// it starts, but not more often than every EEPROM_FLUSH_GAP bytes of text,
+// as each new block costs a few bytes of the little room we have.  The
+// regulatory text is only ever replaced as a whole, and takes nearly
+// twice the room with flushes, so it goes in one block.  On entry
+// *out_len is the space there is, and on return, how much of it the
+// stream fills.
+#define EEPROM_FLUSH_GAP 64
+static int eeprom_deflate(int format,int region,char *text,int from,
+			  unsigned char *out,int at,unsigned long *out_len)
+{
+  const char *dictionary=eeprom_dictionary(format,region);
+  int dictionary_len=strlen(dictionary);
+  int len=strlen(text)+1,scratch_size=2*(dictionary_len+from)+1024;
+  tdefl_compressor *d=malloc(sizeof(tdefl_compressor));
+  unsigned char *scratch=malloc(scratch_size);
+  char *primer=malloc(dictionary_len+from+1);
+  if ((!d)||(!scratch)||(!primer)) {
+    free(d); free(scratch); free(primer);
+    return MZ_MEM_ERROR;
+  }
+  tdefl_init(d,NULL,NULL,
+	     tdefl_create_comp_flags_from_zip_params(9,
+						     format==EEPROM_FORMAT_ZLIB
+						     ?MZ_DEFAULT_WINDOW_BITS
+						     :-MZ_DEFAULT_WINDOW_BITS,
+						     MZ_DEFAULT_STRATEGY));
+
+  // Deflate the dictionary and the text we already have, and throw that
+  // away.  The sync flush leaves us on a byte boundary, and what we
+  // compress next can refer back to what came before.
+  tdefl_status status=TDEFL_STATUS_OKAY;
+  size_t in_bytes,out_bytes;
+  memcpy(primer,dictionary,dictionary_len);
+  memcpy(&primer[dictionary_len],text,from);
+  if (dictionary_len+from) {
+    in_bytes=dictionary_len+from;
+    out_bytes=scratch_size;
+    status=tdefl_compress(d,primer,&in_bytes,scratch,&out_bytes,
+			  TDEFL_SYNC_FLUSH);
+    if ((in_bytes!=dictionary_len+from)||(out_bytes>=scratch_size))
+      status=TDEFL_STATUS_BAD_PARAM;
+  }
+
+  unsigned long used=at;
+  int pos=from;
+  while(status==TDEFL_STATUS_OKAY) {
+    int end=len;
+    if (region==0) {
+      int skip=(len-pos>EEPROM_FLUSH_GAP)?EEPROM_FLUSH_GAP:len-pos;
+      char *eol=memchr(&text[pos+skip],'\n',len-pos-skip);
+      if (eol) end=eol-text+1;
+    }
+    in_bytes=end-pos;
+    out_bytes=*out_len-used;
+    status=tdefl_compress(d,&text[pos],&in_bytes,&out[used],&out_bytes,
+			  end==len?TDEFL_FINISH:TDEFL_SYNC_FLUSH);
+    used+=out_bytes;
+    pos=end;
+    // Running out of space leaves the rest of the output waiting
+    if (used>=*out_len) break;
+  }
+  *out_len=used;
+  free(primer);
+  free(scratch);
+  free(d);
+  if (status==TDEFL_STATUS_DONE) return MZ_OK;
+  return (status==TDEFL_STATUS_OKAY)?MZ_BUF_ERROR:MZ_STREAM_ERROR;
+}
+
+void eeprom_hash_region(unsigned char *datablock,int region)
+{
+  struct eeprom_region *r=&eeprom_regions[region];
+  sha3_Init256();
+  sha3_Update(&datablock[r->start],r->hash-r->start);
+  sha3_Finalize();
+  for(int i=0;i<16;i++) datablock[r->hash+i]=ctx.s[i>>3][i&7];
+}
+
+int eeprom_region_hash_valid(unsigned char *datablock,int region)
+{
+  struct eeprom_region *r=&eeprom_regions[region];
+  sha3_Init256();
+  sha3_Update(&datablock[r->start],r->hash-r->start);
+  sha3_Finalize();
+  for(int i=0;i<16;i++) if (datablock[r->hash+i]!=ctx.s[i>>3][i&7]) return 0;
+  return 1;
+}
+
+// The format the text regions are in.  Without a valid parameter block,
+// we can only assume the original one.
+int eeprom_format(unsigned char *datablock)
+{
+  if (!eeprom_region_hash_valid(datablock,2)) return EEPROM_FORMAT_ZLIB;
+  return datablock[0x7EF];
+}
+
+// Encode text into its region of datablock.  Writing pages is what takes
+// the time, so if we know what the region holds now (current, which may
+// be NULL), we try keeping the stream there up to each of its sync
+// flushes that the new text still begins with, as well as starting afresh,
+// and in each case leave whatever follows the end of the new stream alone.
+// We then use whichever changes the fewest pages.
+int eeprom_encode_text(int format,int region,char *text,
+		       unsigned char *current,unsigned char *datablock,
+		       unsigned long *bytes_used)
+{
+  struct eeprom_region *r=&eeprom_regions[region];
+  int size=r->hash-r->start,len=strlen(text)+1;
+  unsigned char *now=current?&current[r->start]:NULL;
+  // Only an intact region tells us what the radio holds
+  if (now&&!eeprom_region_hash_valid(current,region)) now=NULL;
+  // and we can only continue a stream in the same format
+  int same_format=now&&(eeprom_format(current)==format);
+  unsigned char candidate[0x400],best[0x400];
+  static char decoded[16384];
+  int best_pages=-1,result=MZ_BUF_ERROR,cut,p;
+  unsigned long best_len=0;
+
+  // If it already holds the text, there is nothing to change
+  if (same_format) {
+    unsigned long decoded_len=sizeof(decoded),used=size;
+    if ((eeprom_inflate(format,region,now,&used,decoded,&decoded_len,0)==MZ_OK)
+	&&(decoded_len==len)&&(!memcmp(decoded,text,len))) {
+      memcpy(&datablock[r->start],now,r->end-r->start);
+      *bytes_used=used;
+      return MZ_OK;
+    }
+  }
+
+  for(cut=0;cut<size;cut++) {
+    int from=0;
+    if (cut) {
+      if (!same_format) break;
+      if ((cut<4)||memcmp(&now[cut-4],"\0\0\xff\xff",4)) continue;
+      unsigned long decoded_len=sizeof(decoded),in_len=cut;
+      if (eeprom_inflate(format,region,now,&in_len,decoded,&decoded_len,1)
+	  !=MZ_OK)
+	continue;
+      if ((decoded_len>len)||memcmp(decoded,text,decoded_len)) continue;
+      from=decoded_len;
+    }
+    if (now) memcpy(candidate,now,size);
+    else memset(candidate,0,size);
+    unsigned long used=size;
+    result=eeprom_deflate(format,region,text,from,candidate,cut,&used);
+    if (result!=MZ_OK) continue;
+
+    // Bytes that happen to look like a sync flush won't decode properly
+    unsigned long decoded_len=sizeof(decoded),in_len=size;
+    if ((eeprom_inflate(format,region,candidate,&in_len,decoded,&decoded_len,0)
+	 !=MZ_OK)||(decoded_len!=len)||memcmp(decoded,text,len))
+      continue;
+
+    int pages=0;
+    if (now)
+      for(p=0;p<size;p+=16) if (memcmp(&candidate[p],&now[p],16)) pages++;
+    if ((best_pages<0)||(pages<best_pages)
+	||((pages==best_pages)&&(used<best_len))) {
+      memcpy(best,candidate,size);
+      best_pages=pages;
+      best_len=used;
+    }
+  }
+  if (best_pages<0) return result==MZ_OK?MZ_DATA_ERROR:result;
+  memcpy(&datablock[r->start],best,size);
+  *bytes_used=best_len;
+  return MZ_OK;
+}
 int eeprom_decode_data(unsigned char *datablock,int flags)
 {
 
@@ -155,12 +525,7 @@ int eeprom_decode_data(unsigned char *datablock,int flags)
     configuration_directives_length=0;
     configuration_directives[0]=0;
   
-    sha3_Init256();
-    sha3_Update(&datablock[0x7C0],(0x7F0-0x7C0));
-    sha3_Finalize();
-    int i;
-    for(i=0;i<16;i++) if (datablock[0x7F0+i]!=ctx.s[i>>3][i&7]) break;
-    if (i==16) {
+    if (eeprom_region_hash_valid(datablock,2)) {
       if (!silent_mode)
 	fprintf(stderr,"Radio parameter block checksum valid.\n");
       
@@ -175,7 +540,8 @@ int eeprom_decode_data(unsigned char *datablock,int flags)
       eeprom_radio_parameters.txpower=datablock[0x7E1];
       eeprom_radio_parameters.dutycycle=datablock[0x7E0];
       
-      if (format_version!=0x01) {
+      if ((format_version!=EEPROM_FORMAT_ZLIB)
+	  &&(format_version!=EEPROM_FORMAT_PRESET)) {
 	fprintf(stderr,"Radio parameter block data format version is 0x%02x, which I don't understand.\n",format_version);
 	problems++;
       }
@@ -189,18 +555,15 @@ int eeprom_decode_data(unsigned char *datablock,int flags)
     }
     
     // Parse extended regulatory information (country list etc)
-    sha3_Init256();
-    sha3_Update(&datablock[0x0400],0x7B0-0x400);
-    sha3_Finalize();
-    for(i=0;i<16;i++) if (datablock[0x7B0+i]!=ctx.s[i>>3][i&7]) break;
-    if (i==16) {
+    if (eeprom_region_hash_valid(datablock,1)) {
       if (!silent_mode)
 	fprintf(stderr,
 		"Radio regulatory information text checksum is valid.\n");
       regulatory_information_length=sizeof(regulatory_information);
-      int result=mz_uncompress((unsigned char *)regulatory_information,
-			       &regulatory_information_length,
-			       &datablock[0x400], 0x7B0-0x400);
+      int result=eeprom_uncompress(eeprom_format(datablock),1,
+				   &datablock[0x400],0x7B0-0x400,
+				   regulatory_information,
+				   &regulatory_information_length);
       if (result!=MZ_OK) {
 	fprintf(stderr,"Failed to decompress regulatory information block.\n");
 	problems++;
@@ -214,19 +577,15 @@ int eeprom_decode_data(unsigned char *datablock,int flags)
   }
   
   // Parse user extended information area
-  sha3_Init256();
-  sha3_Update(&datablock[0x000],0x3F0);
-  sha3_Finalize();
-  int i;
-  for(i=0;i<16;i++) if (datablock[0x3F0+i]!=ctx.s[i>>3][i&7]) break;
-  if (i==16) {
+  if (eeprom_region_hash_valid(datablock,0)) {
     if (!silent_mode)
       fprintf(stderr,
 	      "Mesh-Extender configuration directive text checksum is valid.\n");
     configuration_directives_length=sizeof(configuration_directives);
-    int result=mz_uncompress((unsigned char *)configuration_directives,
-			     &configuration_directives_length,
-			     &datablock[0x0], 0x3F0);
+    int result=eeprom_uncompress(eeprom_format(datablock),0,
+				 &datablock[0x0],0x3F0,
+				 configuration_directives,
+				 &configuration_directives_length);
     if (result!=MZ_OK) {
       fprintf(stderr,"Failed to decompress configuration directive block.\n");
       problems++;
@@ -296,6 +655,69 @@ int eeprom_display_data(char *msg)
 }
 
 
+// Binary EEPROM transfers.  Radios send what they read from the EEPROM
+// as binary frames,
+//   $05 $10 <address lo> <address hi> <16 bytes>
+// or, with the checksum that we ask for with !K (and which firmware that
+// supports it acknowledges with "EPRBIN=1"),
+//   $06 $10 <address lo> <address hi> <16 bytes> <checksum>
+// and then also confirm page writes with what they read back, as
+//   $07 $10 <address lo> <address hi> <16 bytes> <checksum>
+// instead of "EEPROM WRITTEN ... READ BACK ..." text.  As for intel hex,
+// the checksum makes all of the bytes in the frame add up to zero.
+// Older firmware sends EPR:<address> : <16 hex bytes> lines instead.
+// No released radio firmware knows !K yet, and we haven't checked what
+// all of them make of it, so we only ask when FLASH900_EEPROM_FRAMES is
+// set, e.g., to test firmware that does.
+#define EEPROM_FRAME_PLAIN 5
+#define EEPROM_FRAME_READ 6
+#define EEPROM_FRAME_WRITTEN 7
+int eeprom_checksummed_frames=0;
+
+// Which 16 byte lines of the EEPROM we have read successfully, so that we
+// can ask again for just those that we haven't.
+#define EEPROM_LINE_UNKNOWN 0
+#define EEPROM_LINE_OK 1
+#define EEPROM_LINE_BAD 2
+unsigned char eeprom_line_state[0x800/16];
+
+// What the radio said when we wrote each 16 byte page, so that we only
+// need to read back the pages whose writes it didn't confirm.
+#define EEPROM_PAGE_UNWRITTEN 0
+#define EEPROM_PAGE_CONFIRMED 1
+#define EEPROM_PAGE_UNCONFIRMED 2
+unsigned char eeprom_page_state[0x800/16];
+
+int eeprom_frame_size()
+{
+  return eeprom_checksummed_frames?2+2+16+1:2+2+16;
+}
+
+// Offset of the first complete frame of the given type for address in
+// buffer whose checksum is right, or -1
+int eeprom_find_frame(unsigned char *buffer,int count,int type,int address)
+{
+  for(int i=0;i+2+2+16+1<=count;i++) {
+    if ((buffer[i]!=type)||(buffer[i+1]!=16)) continue;
+    if ((buffer[i+2]+(buffer[i+3]<<8))!=address) continue;
+    unsigned char sum=0;
+    for(int j=0;j<2+2+16+1;j++) sum+=buffer[i+j];
+    if (!sum) return i;
+  }
+  return -1;
+}
+
+void eeprom_line_read(unsigned char *datablock,int address,
+		      unsigned char *data,int ok)
+{
+  if (address<0||address>0x800-16) return;
+  if (ok) {
+    for(int i=0;i<16;i++) datablock[address+i]=data[i];
+    eeprom_line_state[address>>4]=EEPROM_LINE_OK;
+  } else if (eeprom_line_state[address>>4]!=EEPROM_LINE_OK)
+    eeprom_line_state[address>>4]=EEPROM_LINE_BAD;
+}
+
 int eeprom_parse_line(char *line,unsigned char *datablock)
 {
   int address;
@@ -303,8 +725,8 @@ int eeprom_parse_line(char *line,unsigned char *datablock)
   int err;
   if (sscanf(line,"EPR:%x : READ ERROR #%d",&address,&err)==2)
     {
-      fprintf(stderr,"EEPROM read error #%d @ 0x%x\n",err,address);
-      for(int i=0;i<16;i++) datablock[address+i]=0xee;
+      if (!silent_mode) fprintf(stderr,"EEPROM read error #%d @ 0x%x\n",err,address);
+      eeprom_line_read(datablock,address,NULL,0);
     }
 
   if (sscanf(line,"EPR:%x : %x %x %x %x %x %x %x %x %x %x %x %x %x %x %x %x",
@@ -313,43 +735,36 @@ int eeprom_parse_line(char *line,unsigned char *datablock)
 	     &b[4],&b[5],&b[6],&b[7],
 	     &b[8],&b[9],&b[10],&b[11],
 	     &b[12],&b[13],&b[14],&b[15])==17) {
-    for(int i=0;i<16;i++) datablock[address+i]=b[i];
+    unsigned char data[16];
+    for(int i=0;i<16;i++) data[i]=b[i];
+    eeprom_line_read(datablock,address,data,1);
   }
   
   return 0;
 }
 
-char line[1024];
-int line_len=0;
-
 long long gettime_ms();
 
-int eeprom_parse_output(int fd,unsigned char *datablock, int address)
+// Number of bytes the radio sends back for !C<address>!g!I: the
+// EPRADDR=$<address> reply, and 8 binary frames of 16 bytes.
+int eeprom_reply_bytes(int address)
 {
-  char buffer[16384];
-  int offset=0;
-  int count;
-
-  int bytes=160+15;
+  int bytes=8*eeprom_frame_size()+15;
   if (address<0x10) bytes-=2;
   else if (address<0x100) bytes-=1;
+  return bytes;
+}
+
+// Pick out the EEPROM contents from the radio's reply to one or more reads,
+// whether as binary frames, or text (EPR:xxx : ...) lines.
+int eeprom_parse_bytes(unsigned char *datablock,char *buffer,int count)
+{
+  char line[1024];
+  int line_len=0;
+  unsigned char *bytes=(unsigned char *)buffer;
+  int frame_type=eeprom_checksummed_frames?EEPROM_FRAME_READ:EEPROM_FRAME_PLAIN;
+  int frame_size=eeprom_frame_size();
 
-  long long start=gettime_ms();
-  long long now;
-  while(1) {
-    count=get_radio_reply(fd,&buffer[offset],16384-offset,0);
-    now=gettime_ms();
-    // if (count>0) fprintf(stderr,"* %d bytes at T+%lldms\n",count,now-start);
-    if (count>0) offset+=count;
-    if (offset>=bytes) break;
-    usleep(1000);
-    if ((now-start)>400) break;
-  }
-  count=offset;
-  // now=gettime_ms();
-  // if (count>0) fprintf(stderr,"%d bytes at T+%lldms\n",count,now-start);
-    
-  
   for(int i=0;i<count;i++) {
     if (line_len) {
       if (buffer[i]!='\r')
@@ -360,37 +775,58 @@ int eeprom_parse_output(int fd,unsigned char *datablock, int address)
 	line_len=0;
       }
     } else {
-      if ((buffer[i]=='E')&&(buffer[i+1]=='P')) {
+      if ((i+1<count)&&(buffer[i]=='E')&&(buffer[i+1]=='P')) {
 	line[0]='E'; line_len=1;
       }
-      if ((buffer[i]==5)&&(buffer[i+1]==16)) {
+      if ((i+frame_size<=count)&&(bytes[i]==frame_type)&&(bytes[i+1]==16)) {
 	// Parse binary format right out
-	int address=(unsigned char)buffer[i+2]+((unsigned char)buffer[i+3]<<8);
-	if (address>=0&&address<0x800) {
-	  for(int j=0;j<16;j++) datablock[address+j]=(unsigned char)buffer[i+4+j];
-	  if (0) {
-	    fprintf(stderr,
-		    "Parsed binary line for addr 0x%03X (from %02X %02X %02X %02x) @ 0x%x\n    ",
-		    address,
-		    (unsigned char)buffer[i+0],
-		    (unsigned char)buffer[i+1],
-		    (unsigned char)buffer[i+2],
-		    (unsigned char)buffer[i+3],i
-		    );
-	    for(int j=0;j<16;j++) fprintf(stderr," %02X",datablock[address+j]);
-	    fprintf(stderr,"\n");
-	  }
-	  i+=2+2+16-1;
+	int address=bytes[i+2]+(bytes[i+3]<<8);
+	int ok=1;
+	if (eeprom_checksummed_frames) {
+	  unsigned char sum=0;
+	  for(int j=0;j<frame_size;j++) sum+=bytes[i+j];
+	  ok=!sum;
 	}
+	eeprom_line_read(datablock,address,&bytes[i+4],ok);
+	i+=frame_size-1;
       }
     }
   }
-  if (line_len) eeprom_parse_line(line,datablock);
+  if (line_len) {
+    line[line_len]=0;
+    eeprom_parse_line(line,datablock);
+  }
   
   return 0;
 }
 
-int read_eeprom_block(int fd,unsigned char *readblock,int address)
+int eeprom_parse_output(int fd,unsigned char *datablock, int address)
+{
+  char buffer[16384];
+  int offset=0;
+  int count;
+
+  int bytes=eeprom_reply_bytes(address);
+
+  long long start=gettime_ms();
+  long long now;
+  while(1) {
+    count=get_radio_reply(fd,&buffer[offset],16384-offset,0);
+    now=gettime_ms();
+    // if (count>0) fprintf(stderr,"* %d bytes at T+%lldms\n",count,now-start);
+    if (count>0) offset+=count;
+    if (offset>=bytes) break;
+    usleep(1000);
+    if ((now-start)>400) break;
+  }
+  count=offset;
+  // now=gettime_ms();
+  // if (count>0) fprintf(stderr,"%d bytes at T+%lldms\n",count,now-start);
+
+  return eeprom_parse_bytes(datablock,buffer,count);
+}
+
+void request_eeprom_block(int fd,int address)
 {
   char cmd[1024];
   snprintf(cmd,1024,"!C");
@@ -401,6 +837,11 @@ int read_eeprom_block(int fd,unsigned char *readblock,int address)
   usleep(5000);
   snprintf(cmd,1024,"!I");
   write_radio(fd,(unsigned char *)cmd,strlen(cmd));
+}
+
+int read_eeprom_block(int fd,unsigned char *readblock,int address)
+{
+  request_eeprom_block(fd,address);
   // long long start=gettime_ms();
   eeprom_parse_output(fd,readblock,address);
   // long long end=gettime_ms();
@@ -408,22 +849,133 @@ int read_eeprom_block(int fd,unsigned char *readblock,int address)
   return 0;
 }
 
+// Ask again for any blocks with lines that we didn't get, or which were
+// corrupt.  Lines that we still can't read are filled with $EE.
+int eeprom_reread_lines(int fd,unsigned char *readblock,int start,int end)
+{
+  int address,line,bad=0;
+  for(address=start;address<end;address+=0x80) {
+    int attempts=3;
+    while(attempts--) {
+      for(line=address>>4;line<(address+0x80)>>4;line++)
+	if (eeprom_line_state[line]!=EEPROM_LINE_OK) break;
+      if (line==(address+0x80)>>4) break;
+      read_eeprom_block(fd,readblock,address);
+    }
+    for(line=address>>4;line<(address+0x80)>>4;line++)
+      if (eeprom_line_state[line]!=EEPROM_LINE_OK) {
+	fprintf(stderr,"\nERROR: Could not read EEPROM @ 0x%x\n",line<<4);
+	memset(&readblock[line<<4],0xee,16);
+	bad++;
+      }
+  }
+  return bad;
+}
+
+// Read the 128 byte blocks from start to end, asking for the next block as
+// soon as the radio starts sending the current one, so that we spend the
+// time it takes to send one block asking for the next, instead of waiting
+// for each in turn.  We know where each block ends from how many bytes the
+// radio sends for it.  If last_block() says a block is the last one we
+// need, we stop there (having perhaps read one block more), and return its
+// address.  Otherwise we return end.
+int read_eeprom_blocks(int fd,unsigned char *readblock,int start,int end,
+		       int (*last_block)(unsigned char *readblock,int address))
+{
+  char buffer[16384];
+  int have=0,address=start,next=start,in_flight=0,stop=0,last=end;
+  memset(&eeprom_line_state[start>>4],EEPROM_LINE_UNKNOWN,(end-start)>>4);
+
+  long long last_progress=gettime_ms();
+  while((address<end)&&((!stop)||in_flight)) {
+    // Queue up the next block once this one is on its way
+    if ((!stop)&&(next<end)&&((!in_flight)||(have&&(in_flight<2)))) {
+      request_eeprom_block(fd,next);
+      next+=0x80;
+      in_flight++;
+      last_progress=gettime_ms();
+    }
+
+    int bytes=eeprom_reply_bytes(address);
+    if (have>=bytes) {
+      // The block should end with the binary line for its last 16 bytes.
+      // If not, the radio has said something else (or lost something),
+      // and we can no longer tell which block is which.
+      unsigned char *tail=(unsigned char *)&buffer[bytes-eeprom_frame_size()];
+      if ((tail[0]!=(eeprom_checksummed_frames?EEPROM_FRAME_READ:EEPROM_FRAME_PLAIN))
+	  ||(tail[1]!=16)||(tail[2]+(tail[3]<<8)!=address+0x70)) break;
+
+      eeprom_parse_bytes(readblock,buffer,bytes);
+      memmove(buffer,&buffer[bytes],have-bytes);
+      have-=bytes;
+      in_flight--;
+      if ((!stop)&&last_block&&last_block(readblock,address)) {
+	stop=1;
+	last=address;
+      }
+      if (!silent_mode) fprintf(stderr,".");
+      fflush(stderr);
+      address+=0x80;
+      continue;
+    }
+
+    int count=get_radio_reply(fd,&buffer[have],sizeof(buffer)-have,0);
+    if (count>0) {
+      have+=count;
+      last_progress=gettime_ms();
+      continue;
+    }
+    usleep(1000);
+    if (gettime_ms()-last_progress>400) break;
+  }
+
+  if ((address<end)&&((!stop)||in_flight)) {
+    // Something went wrong, so take what we can from what we have, then
+    // carry on one block at a time from the block we were waiting for.
+    eeprom_parse_bytes(readblock,buffer,have);
+    usleep(100000);
+    clear_waiting_bytes(fd);
+    if (!stop)
+      for(;address<end;address+=0x80) {
+	read_eeprom_block(fd,readblock,address);
+	if (!silent_mode) fprintf(stderr,".");
+	fflush(stderr);
+	if (last_block&&last_block(readblock,address)) {
+	  last=address;
+	  break;
+	}
+      }
+  }
+
+  eeprom_reread_lines(fd,readblock,start,last<end?last+0x80:end);
+  return last;
+}
+
+// Directives end with the first block whose last 3 bytes are all zero
+int eeprom_last_directives_block(unsigned char *readblock,int address)
+{
+  return !(readblock[address+0x7D]
+	   |readblock[address+0x7E]
+	   |readblock[address+0x7F]);
+}
+
 int read_eeprom_directives(int fd,unsigned char *readblock)
 {
-  int address;
   if (!silent_mode) fprintf(stderr,"Reading directives data from EEPROM"); fflush(stderr);
-  for(address=0;address<0x400;address+=0x80) {
-    read_eeprom_block(fd,readblock,address);
-    if (!(readblock[address+0x7D]
-	  |readblock[address+0x7E]
-	  |readblock[address+0x7F]))
-      break;
-    if (!silent_mode) fprintf(stderr,"."); fflush(stderr);
-  }
-  // Make sure we read hash
-  if (address<0x400) {
-    read_eeprom_block(fd,readblock,0x3F0);    
+  int address=
+    read_eeprom_blocks(fd,readblock,0,0x400,eeprom_last_directives_block);
+  if (address<0x380) {
+    // Unless something else wrote it, the directives block is blank after
+    // the streams we have written in it, so assume that is what we skipped,
+    // and make sure we read hash.  If the hash doesn't agree, we were wrong,
+    // and have to read the rest after all.
+    memset(&readblock[address+0x80],0,0x380-(address+0x80));
+    read_eeprom_blocks(fd,readblock,0x380,0x400,NULL);
+    if (!eeprom_region_hash_valid(readblock,0))
+      read_eeprom_blocks(fd,readblock,address+0x80,0x400,NULL);
   }
+  // The parameter block says what format the directives are in
+  read_eeprom_blocks(fd,readblock,0x780,0x800,NULL);
   if (!silent_mode) fprintf(stderr,"\n"); fflush(stderr);
   return 0;
 }
@@ -431,23 +983,35 @@ int read_eeprom_directives(int fd,unsigned char *readblock)
 
 int read_entire_eeprom(int fd,unsigned char *readblock)
 {
-  int address;
   if (!silent_mode) fprintf(stderr,"Reading data from EEPROM"); fflush(stderr);
-  for(address=0;address<0x800;address+=0x80) {
-    read_eeprom_block(fd,readblock,address);
-    if (!silent_mode) fprintf(stderr,"."); fflush(stderr);
-  }
+  read_eeprom_blocks(fd,readblock,0,0x800,NULL);
   if (!silent_mode) fprintf(stderr,"\n"); fflush(stderr);
   return 0;
 }
 
-int write_entire_eeprom(int fd,unsigned char *datablock,unsigned char *readblock)
+// Read just the blocks that hold the regions we want
+int read_eeprom_regions(int fd,unsigned char *readblock,int regions)
+{
+  if (regions&EEPROM_DIRECTIVES) read_eeprom_directives(fd,readblock);
+  if (!(regions&(EEPROM_REGULATORY|EEPROM_PARAMETERS))) return 0;
+  int start=eeprom_regions[(regions&EEPROM_REGULATORY)?1:2].start&~0x7f;
+  int end=eeprom_regions[(regions&EEPROM_PARAMETERS)?2:1].end;
+  if (!silent_mode) fprintf(stderr,"Reading EEPROM $%03x - $%03x",start,end-1);
+  fflush(stderr);
+  read_eeprom_blocks(fd,readblock,start,(end+0x7f)&~0x7f,NULL);
+  if (!silent_mode) fprintf(stderr,"\n");
+  fflush(stderr);
+  return 0;
+}
+
+// Write the 16 byte pages from start to end that differ from readblock
+int write_eeprom_range(int fd,unsigned char *datablock,unsigned char *readblock,
+		       int start,int end)
 {
   // Use <addr>!g!y<data>!w sequence to write each 16 bytes
   int problems=0,address;
-  if (!silent_mode) fprintf(stderr,"Writing data to EEPROM\n"); fflush(stderr);
   
-  for(address=0;address<0x800;address+=0x10) {
+  for(address=start;address<end;address+=0x10) {
     
     // Only write if it has changed
     int changed=0;
@@ -470,10 +1034,25 @@ int write_entire_eeprom(int fd,unsigned char *datablock,unsigned char *readblock
     }
     
     problems+=result;
+    eeprom_page_state[address>>4]=result?EEPROM_PAGE_UNCONFIRMED:EEPROM_PAGE_CONFIRMED;
         
     if (!silent_mode)
       fprintf(stderr,"\rWrote $%x - $%x",address,address+0x10-1); fflush(stderr);
   }
+  return problems;
+}
+
+int write_eeprom_regions(int fd,unsigned char *datablock,unsigned char *readblock,
+			 int regions)
+{
+  int problems=0,r;
+  if (!silent_mode) fprintf(stderr,"Writing data to EEPROM\n");
+  fflush(stderr);
+  memset(eeprom_page_state,EEPROM_PAGE_UNWRITTEN,sizeof(eeprom_page_state));
+  for(r=0;r<EEPROM_REGIONS;r++)
+    if (regions&(1<<r))
+      problems+=write_eeprom_range(fd,datablock,readblock,
+				   eeprom_regions[r].start,eeprom_regions[r].end);
   if (!silent_mode) fprintf(stderr,"\n");
   if (problems)
     fprintf(stderr,
@@ -481,77 +1060,261 @@ int write_entire_eeprom(int fd,unsigned char *datablock,unsigned char *readblock
   return problems;
 }
 
+// Build the given regions of datablock, with the text in the given format,
+// changing as little of what the radio holds now (current, if we know it)
+// as we can.  Text for regions we aren't building may be NULL.
+int eeprom_build_regions(int regions,int format,
+			 char *configuration_directives_normalised,
+			 char *regulatory_information,
+			 struct radio_parameters radio_parameters,
+			 unsigned char *current,
+			 unsigned char *datablock)
+{
+  int result;
+  if (regions&EEPROM_DIRECTIVES) {
+    unsigned long bytes_used;
+    result=eeprom_encode_text(format,0,configuration_directives_normalised,
+			      current,datablock,&bytes_used);
+    if (result!=MZ_OK) {
+      fprintf(stderr,"Failed to compress configuration directives (MZ result=%d.\n",
+	      result);
+      return(-1);
+    }
+    // Mesh Extender configuration directive block
+    eeprom_hash_region(datablock,0);
+  }
+
+  if (regions&EEPROM_REGULATORY) {
+    unsigned long bytes_used;
+    result=eeprom_encode_text(format,1,regulatory_information,
+			      current,datablock,&bytes_used);
+    if (result!=MZ_OK) {
+      fprintf(stderr,"Failed to compress regulatory information (MZ result=%d.\n",
+	      result);
+      return(-1);
+    } else
+      if (!silent_mode)
+	fprintf(stderr,"Regulatory information text required %d bytes (0x%03x-0x%03x)\n",
+		(int)bytes_used,0x400,0x400+(int)bytes_used);
+    // Regulatory info block
+    eeprom_hash_region(datablock,1);
+  }
+
+  if (regions&EEPROM_PARAMETERS) {
+    memset(&datablock[0x7C0],0,0x7F0-0x7C0);
+    // Set format version
+    datablock[0x7EF]=format;
+    // Set other radio fields for use by RFD900 radio (and also for LBARD display)
+    datablock[0x7ED]=radio_parameters.primary_country[0];
+    datablock[0x7EE]=radio_parameters.primary_country[1];
+    datablock[0x7E8]=radio_parameters.lock_firmware;
+    datablock[0x7E6]=radio_parameters.airspeed&0xff;
+    datablock[0x7E7]=radio_parameters.airspeed>>8;
+    datablock[0x7E2]=(radio_parameters.frequency>>0)&0xff;
+    datablock[0x7E3]=(radio_parameters.frequency>>8)&0xff;
+    datablock[0x7E4]=(radio_parameters.frequency>>16)&0xff;
+    datablock[0x7E5]=(radio_parameters.frequency>>24)&0xff;
+    datablock[0x7E1]=radio_parameters.txpower;
+    datablock[0x7E0]=radio_parameters.dutycycle;
+    // Radio parameter block
+    eeprom_hash_region(datablock,2);
+  }
+
+  return 0;
+}
+
 int eeprom_build_image(char *configuration_directives_normalised,
 		       char *regulatory_information,
 		       struct radio_parameters radio_parameters,
 		       unsigned char *datablock)
 {
-  unsigned long bytes_used=0x3F0;
-  int result=mz_compress2(&datablock[0x000],&bytes_used,
-			  (unsigned char *)configuration_directives_normalised,
-			  strlen(configuration_directives_normalised)+1,9);
-  if (result!=MZ_OK) {
-    fprintf(stderr,"Failed to compress configuration directives (MZ result=%d.\n",
-	    result);
-    return(-1);
+  return eeprom_build_regions(EEPROM_ALL_REGIONS,EEPROM_FORMAT_CURRENT,
+			      configuration_directives_normalised,
+			      regulatory_information,radio_parameters,
+			      NULL,datablock);
+}
+
+// Read just the hashes at the end of each region, and return the regions
+// whose hash is already that of datablock, and so hold just what it does.
+int eeprom_matching_hashes(int fd,unsigned char *datablock,
+			   unsigned char *readblock,int regions)
+{
+  int r,matching=0,last_block=-1;
+  if (!silent_mode) fprintf(stderr,"Reading EEPROM hashes");
+  fflush(stderr);
+  for(r=0;r<EEPROM_REGIONS;r++) {
+    if (!(regions&(1<<r))) continue;
+    int block=eeprom_regions[r].hash&~0x7f;
+    if (block!=last_block)
+      read_eeprom_blocks(fd,readblock,block,block+0x80,NULL);
+    last_block=block;
+    if (!memcmp(&readblock[eeprom_regions[r].hash],
+		&datablock[eeprom_regions[r].hash],16))
+      matching|=1<<r;
   }
-  
-  bytes_used=0x7B0-0x400;
-  result=mz_compress2(&datablock[0x400],&bytes_used,
-		      (unsigned char *)regulatory_information,
-		      strlen(regulatory_information)+1,9);
-  if (result!=MZ_OK) {
-    fprintf(stderr,"Failed to compress regulatory information (MZ result=%d.\n",
-	    result);
-    return(-1);
-  } else
+  if (!silent_mode) fprintf(stderr,"\n");
+  fflush(stderr);
+  return matching;
+}
+
+// We keep a copy of the EEPROM of the radio on each serial port, so that
+// we can answer questions about the directives without reading them all
+// again.  Only regions that were intact when we read or wrote them are
+// kept, and we only use them if the radio's hashes still match.
+//
+// We usually run as root, so rather than use predictable names in /tmp
+// itself, where anyone could plant a symlink, the copies go in a directory
+// of our own there, which we only use if nobody else can write to it.
+int eeprom_cache_dir(char *dir,int size)
+{
+  char *env=getenv("FLASH900_CACHE_DIR");
+  if (env&&env[0]) {
+    snprintf(dir,size,"%s",env);
+    return 0;
+  }
+  struct stat st;
+  snprintf(dir,size,"/tmp/flash900-%d",(int)getuid());
+  mkdir(dir,0700);
+  if (lstat(dir,&st)||(!S_ISDIR(st.st_mode))||(st.st_uid!=getuid())
+      ||(st.st_mode&(S_IWGRP|S_IWOTH))) {
     if (!silent_mode)
-      fprintf(stderr,"Regulatory information text required %d bytes (0x%03x-0x%03x)\n",
-	      (int)bytes_used,0x400,0x400+(int)bytes_used);
-
-  // Set format version
-  datablock[0x7EF]=0x01;
-  // Set other radio fields for use by RFD900 radio (and also for LBARD display)
-  datablock[0x7ED]=radio_parameters.primary_country[0];
-  datablock[0x7EE]=radio_parameters.primary_country[1];
-  datablock[0x7E8]=radio_parameters.lock_firmware;
-  datablock[0x7E6]=radio_parameters.airspeed&0xff;
-  datablock[0x7E7]=radio_parameters.airspeed>>8;
-  datablock[0x7E2]=(radio_parameters.frequency>>0)&0xff;
-  datablock[0x7E3]=(radio_parameters.frequency>>8)&0xff;
-  datablock[0x7E4]=(radio_parameters.frequency>>16)&0xff;
-  datablock[0x7E5]=(radio_parameters.frequency>>24)&0xff;
-  datablock[0x7E1]=radio_parameters.txpower;
-  datablock[0x7E0]=radio_parameters.dutycycle;
-  
-  // Write hashes
-  int i;
-  
-  // Mesh Extender configuration directive block
-  sha3_Init256();
-  sha3_Update(&datablock[0],0x3F0);
-  sha3_Finalize();
-  for(i=0;i<16;i++) datablock[0x3F0+i]=ctx.s[i>>3][i&7];
-  
-  // Regulatory info block
-  sha3_Init256();
-  sha3_Update(&datablock[0x400],0x7B0-0x400);
-  sha3_Finalize();
-  for(i=0;i<16;i++) datablock[0x7B0+i]=ctx.s[i>>3][i&7];
-  
-  // Radio parameter block
-  sha3_Init256();
-  sha3_Update(&datablock[0x7C0],0x7F0-0x7C0);
-  sha3_Finalize();
-  for(i=0;i<16;i++) datablock[0x7F0+i]=ctx.s[i>>3][i&7];
+      fprintf(stderr,"Not keeping a copy of the EEPROM, as '%s' is not a private directory.\n",dir);
+    return -1;
+  }
+  return 0;
+}
 
+int eeprom_cache_path(char *port,char *path,int size)
+{
+  char dir[1024];
+  if (eeprom_cache_dir(dir,sizeof(dir))) return -1;
+  int len=snprintf(path,size,"%s/flash900-eeprom-",dir);
+  if (len>=size-5) return -1;
+  for(;*port&&(len<size-5);port++) path[len++]=(*port=='/')?'_':*port;
+  snprintf(&path[len],size-len,".bin");
   return 0;
 }
 
+int eeprom_cache_load(char *port,unsigned char *image)
+{
+  char path[1024];
+  if (eeprom_cache_path(port,path,sizeof(path))) return -1;
+  FILE *f=fopen(path,"rb");
+  if (!f) return -1;
+  int len=fread(image,1,0x800,f);
+  fclose(f);
+  return (len==0x800)?0:-1;
+}
+
+void eeprom_cache_save(char *port,unsigned char *image,int regions)
+{
+  char path[1024],tempname[1100];
+  unsigned char cached[0x800];
+  int r;
+  if (eeprom_cache_load(port,cached)) memset(cached,0,sizeof(cached));
+  for(r=0;r<EEPROM_REGIONS;r++)
+    if ((regions&(1<<r))&&eeprom_region_hash_valid(image,r))
+      memcpy(&cached[eeprom_regions[r].start],&image[eeprom_regions[r].start],
+	     eeprom_regions[r].end-eeprom_regions[r].start);
+  // Write a new file that nobody else can have made, and then rename it
+  // into place, which replaces whatever is there rather than following it.
+  char dir[1024];
+  if (eeprom_cache_path(port,path,sizeof(path))
+      ||eeprom_cache_dir(dir,sizeof(dir))) return;
+  snprintf(tempname,sizeof(tempname),"%s/flash900-eeprom-XXXXXX",dir);
+  int fd=mkstemp(tempname);
+  if (fd==-1) return;
+  int len=write(fd,cached,0x800);
+  if (close(fd)||(len!=0x800)||rename(tempname,path)) unlink(tempname);
+}
+
+// Forget what we know, before we change it
+void eeprom_cache_invalidate(char *port)
+{
+  char path[1024];
+  if (!eeprom_cache_path(port,path,sizeof(path))) unlink(path);
+}
+
+// Read the directives, and the parameter block that says what format
+// they are in, from our copy if the radio's hashes say it is still right.
+int read_eeprom_directives_cached(int fd,char *port,unsigned char *readblock)
+{
+  unsigned char cached[0x800];
+  int regions=EEPROM_DIRECTIVES|EEPROM_PARAMETERS;
+  if ((!eeprom_cache_load(port,cached))
+      &&eeprom_region_hash_valid(cached,0)
+      &&eeprom_region_hash_valid(cached,2)
+      &&(eeprom_matching_hashes(fd,cached,readblock,regions)==regions)) {
+    memcpy(readblock,cached,0x800);
+    return 0;
+  }
+  read_eeprom_directives(fd,readblock);
+  eeprom_cache_save(port,readblock,regions);
+  return 0;
+}
+
+// The regions in which datablock differs from readblock
+int eeprom_changed_regions(unsigned char *datablock,unsigned char *readblock,
+			   int regions)
+{
+  int r;
+  for(r=0;r<EEPROM_REGIONS;r++)
+    if ((regions&(1<<r))
+	&&(!memcmp(&datablock[eeprom_regions[r].start],
+		   &readblock[eeprom_regions[r].start],
+		   eeprom_regions[r].end-eeprom_regions[r].start)))
+      regions&=~(1<<r);
+  return regions;
+}
+
+// Check the regions we wrote, and count the bytes that are wrong.  The
+// radio reads back each page as it writes it, and pages that we didn't
+// write matched what we read from it (or what we kept of it, checked
+// against its hashes) just before, so we only need to read the blocks
+// holding pages whose writes it didn't confirm.
+int eeprom_verify_regions(int fd,unsigned char *datablock,
+			  unsigned char *readblock,
+			  unsigned char *verifyblock,int regions)
+{
+  int problems=0,r,address,block;
+  int reread[0x800/0x80];
+  memset(reread,0,sizeof(reread));
+  for(r=0;r<EEPROM_REGIONS;r++)
+    if (regions&(1<<r))
+      for(address=eeprom_regions[r].start;address<eeprom_regions[r].end;
+	  address+=0x10) {
+	int state=eeprom_page_state[address>>4];
+	if ((state==EEPROM_PAGE_CONFIRMED)
+	    ||((state==EEPROM_PAGE_UNWRITTEN)&&readblock
+	       &&(!memcmp(&datablock[address],&readblock[address],0x10))))
+	  memcpy(&verifyblock[address],&datablock[address],0x10);
+	else reread[address>>7]=1;
+      }
+  for(block=0;block<0x800/0x80;block++) {
+    if (!reread[block]) continue;
+    int end=block;
+    while((end<0x800/0x80)&&reread[end]) end++;
+    if (!silent_mode) fprintf(stderr,"Reading back EEPROM $%03x - $%03x",
+			      block<<7,(end<<7)-1);
+    fflush(stderr);
+    read_eeprom_blocks(fd,verifyblock,block<<7,end<<7,NULL);
+    if (!silent_mode) fprintf(stderr,"\n");
+    fflush(stderr);
+    block=end;
+  }
+  for(r=0;r<EEPROM_REGIONS;r++)
+    if (regions&(1<<r))
+      for(address=eeprom_regions[r].start;address<eeprom_regions[r].end;address++)
+	if (verifyblock[address]!=datablock[address]) problems++;
+  return problems;
+}
+
 void usage()
 {
   fprintf(stderr,"Version 20170824.1145.1\n");
   fprintf(stderr,"usage: flash900 <firmware> <serial port> [force|verify|230400|115200|57600]\n");
+  fprintf(stderr,"       (<firmware> may be - or a named pipe to write intel hex as it arrives)\n");
+  fprintf(stderr,"       (otherwise <firmware>-XX-YY.fw, .ihx.gz, .ihx.deflate or .ihx is used for board XX, frequency YY,\n        or else the variant in <firmware>.bundle)\n");
 
   fprintf(stderr,"usage: flash900 eeprom <serial port> [<Mesh Extender configuration directives|\"\"> <alternate regulatory information|\"\"> <frequency> <txpower> <dutycycle> <airspeed> <primary country 2-letter code> <firmware lock (Y|N)> <full list of ISO 2-letter country codes>]\n");
   fprintf(stderr,"       flash900 eeprom <serial port> directives\n");
@@ -560,77 +1323,200 @@ void usage()
   fprintf(stderr,"       flash900 eeprom <serial port> directives get <key>\n");
   fprintf(stderr,"       flash900 eeprom <serial port> directives del <key>\n");
   fprintf(stderr,"       flash900 eeprom <serial port> directives set <key> <value>\n");
+  fprintf(stderr,"       flash900 eeprom <serial port> directives <set <key> <value>|del <key>|clear> ...\n");
+  fprintf(stderr,"       flash900 eeprom <serial port> directives batch <file, with one set, del or clear per line|->\n");
+  fprintf(stderr,"       flash900 eeprom <serial port> image <EEPROM image file>\n");
+  fprintf(stderr,"       flash900 eeprom-image build <EEPROM image file> <the same parameters as for eeprom <serial port>>\n");
+  fprintf(stderr,"       flash900 eeprom-image show <EEPROM image file>\n");
+  fprintf(stderr,"       flash900 eeprom-image batch <CSV file|-> <output directory> [<processes>]\n");
+  fprintf(stderr,"       (with one line per unit, of its name then the same parameters as for eeprom <serial port>)\n");
   fprintf(stderr,"       flash900 linkmon <serial port 1> <serial port 2>\n");
+  fprintf(stderr,"       flash900 bench hash [iterations]\n");
+  fprintf(stderr,"       flash900 bench parse [megabytes]\n");
+  fprintf(stderr,"       flash900 bench copy [iterations]\n");
+  fprintf(stderr,"       flash900 pack <firmware.ihx> <firmware.fw> [<board id> <frequency id>]\n");
+  fprintf(stderr,"       flash900 index <firmware>\n");
+  fprintf(stderr,"       flash900 bundle <firmware>\n");
+  fprintf(stderr,"       flash900 diff <old firmware> <new firmware> [<baud> [<latency ms> [<erase ms>]]]\n");
+  fprintf(stderr,"       (either may be a bundle, given as <bundle>:XX-YY for board XX, frequency YY)\n");
   fprintf(stderr," e.g.: flash900 eeprom /dev/cu.usbserial-AARDVARK \"OTABID=918f8a6684c861f68c1f6c468c4c684\\nMESHEXTENDERNAME=Adelaide1\\nLATITUDE=-35\\nLONGITUDE=+138\\n\" \"\" 923000000 24 100 128 AU N AU,NZ,US,CA,VU\n");
   fprintf(stderr," e.g.: flash900 eeprom /dev/cu.usbserial-AARDVARK\n");
   fprintf(stderr," e.g.: flash900 eeprom /dev/cu.usbserial-AARDVARK directive get OTABID\n");
   fprintf(stderr," e.g.: flash900 eeprom /dev/cu.usbserial-AARDVARK directive set MESHEXTENDERNAME \"my mesh extender\"\n");
+  fprintf(stderr," e.g.: flash900 eeprom /dev/cu.usbserial-AARDVARK directives set LATITUDE -35 set LONGITUDE +138 del OTABID\n");
+  fprintf(stderr,"Set FLASH900_EEPROM_FRAMES=1 to ask radio firmware that supports it for checksummed EEPROM transfers.\n");
+  fprintf(stderr,"Copies of each radio's EEPROM are kept in $FLASH900_CACHE_DIR (default /tmp/flash900-<uid>).\n");
   return;
 }
 
 int silent_mode=0;
 
-int eeprom_program(int argc,char **argv)
+// Work out what to record for a unit from the same nine arguments that
+// "flash900 eeprom <serial port> ..." takes: directives (with \n etc.
+// escapes), regulatory text, frequency, txpower, duty cycle, air speed,
+// primary country, firmware lock and country list.  The regulatory text
+// goes into regulatory_information, generated from the rest if not given.
+void eeprom_unit_from_args(char **args,char *configuration_directives_normalised,
+			   struct radio_parameters *radio_parameters)
 {
-  if ((argc!=12)&&((argc<3)||(argc>7))) {
-    usage(); exit(-1);
+  char *configuration_directives_input=args[0];
+  char *regulatory_information_input=args[1];
+  char *country_list=args[8];
+
+  int cdn_len=0;
+  for(int i=0;configuration_directives_input[i]&&(cdn_len<16383);i++) {
+    if (configuration_directives_input[i]=='\\') {
+      i++;
+      switch(configuration_directives_input[i]) {
+      case 'n': configuration_directives_normalised[cdn_len++]='\n'; break;
+      case 'r': configuration_directives_normalised[cdn_len++]='\r'; break;
+      case 'b': configuration_directives_normalised[cdn_len++]='\b'; break;
+      case '\\': configuration_directives_normalised[cdn_len++]='\\'; break;
+      }
+      if (!configuration_directives_input[i]) break;
+    } else configuration_directives_normalised[cdn_len++]
+	     =configuration_directives_input[i];
   }
-  
+  configuration_directives_normalised[cdn_len]=0;
+
+  // Set actual radio parameters
+  radio_parameters->frequency=atoi(args[2]);
+  radio_parameters->txpower=atoi(args[3]?args[3]:"0");  
+  radio_parameters->dutycycle=atoi(args[4]?args[4]:"0");  
+  radio_parameters->airspeed=atoi(args[5]?args[5]:"0");
+  radio_parameters->primary_country[0]=args[6][0];
+  radio_parameters->primary_country[1]=args[6][0]?args[6][1]:0;
+  radio_parameters->lock_firmware=args[7][0];
+
+  // Generate default regulatory information, if required
+  if (!regulatory_information_input[0]) {
+    generate_regulatory_information(regulatory_information,
+				    16384,
+				    radio_parameters->primary_country,
+				    country_list,
+				    radio_parameters->frequency,
+				    radio_parameters->txpower,
+				    radio_parameters->dutycycle);
+    if (!silent_mode)
+      fprintf(stderr,"Auto-generating regulatory boilerplate information text"
+	      " (%d bytes long).\n",(int)strlen(regulatory_information));
+  } else {
+    strncpy(regulatory_information,regulatory_information_input,16384);
+    regulatory_information[16383]=0;
+    if (!silent_mode)
+      fprintf(stderr,"Using user-supplied regulatory information text.\n");
+  }
+}
+
+// EEPROM images are just the 2KB of EEPROM, as a file
+int eeprom_image_load(char *filename,unsigned char *datablock)
+{
+  FILE *f=fopen(filename,"r");
+  if (!f) {
+    fprintf(stderr,"Could not open EEPROM image '%s'\n",filename);
+    return -1;
+  }
+  int bytes=fread(datablock,1,2048,f);
+  int extra=fgetc(f);
+  fclose(f);
+  if ((bytes!=2048)||(extra!=EOF)) {
+    fprintf(stderr,"EEPROM image '%s' is not 2048 bytes long\n",filename);
+    return -1;
+  }
+  return 0;
+}
+
+int eeprom_image_save(char *filename,unsigned char *datablock)
+{
+  FILE *f=fopen(filename,"w");
+  if (!f) {
+    fprintf(stderr,"Could not create EEPROM image '%s'\n",filename);
+    return -1;
+  }
+  int bytes=fwrite(datablock,1,2048,f);
+  if (fclose(f)||(bytes!=2048)) {
+    fprintf(stderr,"Could not write EEPROM image '%s'\n",filename);
+    unlink(filename);
+    return -1;
+  }
+  return 0;
+}
+
+// Build the image for a unit, from the same arguments as
+// eeprom_unit_from_args() takes
+int eeprom_image_build(char **args,char *filename)
+{
+  char configuration_directives_normalised[16384];
+  struct radio_parameters radio_parameters;
+  unsigned char datablock[2048];
+  memset(datablock,0,sizeof(datablock));
+  eeprom_unit_from_args(args,configuration_directives_normalised,
+			&radio_parameters);
+  if (eeprom_build_image(configuration_directives_normalised,
+			 regulatory_information,radio_parameters,datablock)) {
+    fprintf(stderr,"Could not build EEPROM image '%s'\n",filename);
+    return -1;
+  }
+  return eeprom_image_save(filename,datablock);
+}
+
+int eeprom_program(int argc,char **argv)
+{
   int parameters_set=0;
   int parameters_show=0;
   int directive_get=0;
-  int directive_set=0;
   int directive_list=0;
-  int directive_clear=0;
   char *directive_key=NULL;
-  char *directive_value=NULL;
+  char *image_file=NULL;
   int dump=0;
   
-  if ((argc>3)&&(argc<8)) {
+  if ((argc>3)&&((!strcasecmp(argv[3],"dump"))
+		 ||(!strcasecmp(argv[3],"directives")))) {
     if (!strcasecmp(argv[3],"dump")) {
+      if (argc!=4) { usage(); exit(-1); }
       dump=1;
     }
-    else if (strcasecmp(argv[3],"directives")) { usage(); exit(-1); }
     silent_mode=1;
     if (argc>4) {
-      if (!strcasecmp(argv[4],"clear")) {
-	if (argc==5) directive_clear=1;
-      } else if (!strcasecmp(argv[4],"list")) {
+      if (!strcasecmp(argv[4],"list")) {
 	if (argc==5) directive_list=1;
+	else { usage(); exit(-1); }
       } else if (!strcasecmp(argv[4],"get")) {
 	if (argc==6) {
 	  directive_get=1;
 	  directive_key=argv[5];
 	} else { usage(); exit(-1); }
-      } else if (!strcasecmp(argv[4],"del")) {
-	if (argc==6) {
-	  directive_key=argv[5];
-	  directive_value="";
-	  directive_set=1;
-	}	
-      } else if (!strcasecmp(argv[4],"set")) {
-	if (argc==7) {
-	  directive_key=argv[5];
-	  directive_value=argv[6];
-	  directive_set=1;
-	} else { usage(); exit(-1); }
-      } else  { usage(); exit(-1); }
+      } else if (!strcasecmp(argv[4],"batch")) {
+	if (argc!=6) { usage(); exit(-1); }
+	if (directive_ops_from_file(argv[5])) exit(-1);
+      } else if (directive_ops_parse(&argv[4],argc-4)) { usage(); exit(-1); }
     }
   }
-  if (argc==12) parameters_set=1;
-  if (argc==3) parameters_show=1;
+  else if ((argc==5)&&(!strcasecmp(argv[3],"image"))) image_file=argv[4];
+  else if (argc==12) parameters_set=1;
+  else if (argc==3) parameters_show=1;
+  else { usage(); exit(-1); }
 
   struct radio_parameters radio_parameters;
   
   char *configuration_directives_input=argv[3];
-  char *regulatory_information_input=argv[4];
-  char *country_list=argv[11];
 
   // Start with blank memory block
   unsigned char datablock[2048];
   memset(&datablock[0],0,2048-64);
   memset(&datablock[2048-64],0,64);
 
+  // Check an image we are to write before we go near the radio
+  if (image_file) {
+    if (eeprom_image_load(image_file,datablock)) exit(-1);
+    for(int r=0;r<EEPROM_REGIONS;r++)
+      if (!eeprom_region_hash_valid(datablock,r)) {
+	fprintf(stderr,"EEPROM image '%s' is corrupt: region $%03x - $%03x has the wrong hash\n",
+		image_file,eeprom_regions[r].start,eeprom_regions[r].end-1);
+	exit(-1);
+      }
+  }
+
   int fd=open(argv[2],O_RDWR);
   if (fd==-1) {
     fprintf(stderr,"Could not open serial port '%s'\n",argv[2]);
@@ -657,9 +1543,13 @@ int eeprom_program(int argc,char **argv)
       fprintf(stderr,"RFD900+ undetected.\n");
       exit(-1);
     }
+    eeprom_negotiate_frames(fd);
   }
 
   unsigned char readblock[2048];
+  memset(readblock,0,sizeof(readblock));
+  // The regions of datablock that we have built, and so need to write
+  int regions=0;
 
   if (parameters_set) {
     // Compress user data and alternate regulatory information into EEPROM.
@@ -667,60 +1557,70 @@ int eeprom_program(int argc,char **argv)
     // information based on the set of countries listed.
 
     char configuration_directives_normalised[16384];
-    int cdn_len=0;
-    for(int i=0;configuration_directives_input[i];i++) {
-      if (configuration_directives_input[i]=='\\') {
-	i++;
-	switch(configuration_directives_input[i]) {
-	case 'n': configuration_directives_normalised[cdn_len++]='\n'; break;
-	case 'r': configuration_directives_normalised[cdn_len++]='\r'; break;
-	case 'b': configuration_directives_normalised[cdn_len++]='\b'; break;
-	case '\\': configuration_directives_normalised[cdn_len++]='\\'; break;
-	}
-      } else configuration_directives_normalised[cdn_len++]
-	       =configuration_directives_input[i];
-    }
-
-    // Set actual radio parameters
-    radio_parameters.frequency=atoi(argv[5]);
-    radio_parameters.txpower=atoi(argv[6]?argv[6]:"0");  
-    radio_parameters.dutycycle=atoi(argv[7]?argv[7]:"0");  
-    radio_parameters.airspeed=atoi(argv[8]?argv[8]:"0");
-    radio_parameters.primary_country[0]=argv[9][0];
-    radio_parameters.primary_country[1]=argv[9][1];
-    radio_parameters.lock_firmware=argv[10][0];
-
-    // Generate default regulatory information, if required
-    if (!regulatory_information_input[0]) {
-      generate_regulatory_information(regulatory_information,
-				      16384,
-				      radio_parameters.primary_country,
-				      country_list,
-				      radio_parameters.frequency,
-				      radio_parameters.txpower,
-				      radio_parameters.dutycycle);
-      fprintf(stderr,"Auto-generating regulatory boilerplate information text"
-	      " (%d bytes long).\n",(int)strlen(regulatory_information));
-    } else {
-      strncpy(regulatory_information,regulatory_information_input,16384);
-      fprintf(stderr,"Using user-supplied regulatory information text.\n");
+    eeprom_unit_from_args(&argv[3],configuration_directives_normalised,
+			  &radio_parameters);
+
+    // Keep the old configuration directives, unless we have been given some,
+    // or they are in an older format than the one we are about to record.
+    // Most of the time, most or all of what we are asked to write is there
+    // already.  If a region's hash is already that of the region as we
+    // would build it, it holds just that, so check those first, and leave
+    // out the regions that match.  How we build a region depends on what
+    // the radio held before, so build against our copy of it if we have
+    // one; if that is out of date, the hashes just won't match.
+    regions=EEPROM_REGULATORY|EEPROM_PARAMETERS;
+    if (configuration_directives_input[0]) regions|=EEPROM_DIRECTIVES;
+    unsigned char cached[0x800];
+    int have_cached=!eeprom_cache_load(argv[2],cached);
+    int was_silent=silent_mode;
+    silent_mode=1;
+    if (eeprom_build_regions(regions,EEPROM_FORMAT_CURRENT,
+			     configuration_directives_normalised,
+			     regulatory_information,
+			     radio_parameters,
+			     have_cached?cached:NULL,
+			     datablock)) {
+      fprintf(stderr,"Could not build datablock to write to EEPROM.\n");
+      exit(-1);
     }
+    silent_mode=was_silent;
+    regions&=~eeprom_matching_hashes(fd,datablock,readblock,regions);
 
-    if (!configuration_directives_input[0]) {
-      // Keep old configuration directives
+    // Read what is there now of the rest, so that we can change as little of
+    // it as possible.  We always have the parameter block by now, so know
+    // if the directives we are keeping are in an older format than the one
+    // we are about to record.
+    read_eeprom_regions(fd,readblock,regions);
+    eeprom_cache_save(argv[2],readblock,regions);
+    if ((regions&EEPROM_PARAMETERS)
+	&&(eeprom_format(readblock)!=EEPROM_FORMAT_CURRENT)
+	&&(!(regions&EEPROM_DIRECTIVES))) {
       read_eeprom_directives(fd,readblock);
       eeprom_decode_data(readblock,DIRECTIVES_ONLY);
       strcpy(configuration_directives_normalised,
 	     configuration_directives);
+      regions|=EEPROM_DIRECTIVES;
     }
     
-    if (eeprom_build_image(configuration_directives_normalised,
-			   regulatory_information,
-			   radio_parameters,
-			   datablock)) {
+    if (eeprom_build_regions(regions,EEPROM_FORMAT_CURRENT,
+			     configuration_directives_normalised,
+			     regulatory_information,
+			     radio_parameters,
+			     readblock,
+			     datablock)) {
       fprintf(stderr,"Could not build datablock to write to EEPROM.\n");
       exit(-1);
     }
+    regions=eeprom_changed_regions(datablock,readblock,regions);
+  }
+
+  if (image_file) {
+    // The image is already built, so we need only write the regions of it
+    // that the radio doesn't have already.
+    regions=EEPROM_ALL_REGIONS;
+    regions&=~eeprom_matching_hashes(fd,datablock,readblock,regions);
+    read_eeprom_regions(fd,readblock,regions);
+    regions=eeprom_changed_regions(datablock,readblock,regions);
   }
 
   if (dump) {
@@ -731,7 +1631,7 @@ int eeprom_program(int argc,char **argv)
   }
   
   if (directive_list) {
-    read_eeprom_directives(fd,readblock);
+    read_eeprom_directives_cached(fd,argv[2],readblock);
     eeprom_decode_data(readblock,DIRECTIVES_ONLY);
     directives_to_list();
     for(int i=0;i<directive_count;i++)
@@ -740,7 +1640,7 @@ int eeprom_program(int argc,char **argv)
   }
   
   if (directive_get) {
-    read_eeprom_directives(fd,readblock);
+    read_eeprom_directives_cached(fd,argv[2],readblock);
     eeprom_decode_data(readblock,DIRECTIVES_ONLY);
     directives_to_list();
     for(int i=0;i<directive_count;i++)
@@ -749,61 +1649,42 @@ int eeprom_program(int argc,char **argv)
     return 0;
   }
 
-  if (directive_clear) {
-    read_entire_eeprom(fd,readblock);
-    eeprom_decode_data(readblock,READ_ALL);
-    configuration_directives[0]=0;
-    if (eeprom_build_image(configuration_directives,
-			   regulatory_information,
-			   eeprom_radio_parameters,
-			   datablock)) {
-      fprintf(stderr,"Could not build datablock to write to EEPROM.\n");
-      exit(-1);
-    }
-    write_entire_eeprom(fd,datablock,readblock);    
-  }
-
-  if (directive_set) {
-    read_entire_eeprom(fd,readblock);
-    eeprom_decode_data(readblock,READ_ALL);
+  if (directive_op_count) {
+    // Only the directives change, so we need nothing else from the radio,
+    // and keep to the format its parameter block says they are in.
+    read_eeprom_directives_cached(fd,argv[2],readblock);
+    eeprom_decode_data(readblock,DIRECTIVES_ONLY);
     directives_to_list();
-    directive_set_value(directive_key,directive_value);
+    directive_ops_apply();
     directives_from_list();
-    if (eeprom_build_image(configuration_directives,
-			   regulatory_information,
-			   eeprom_radio_parameters,
-			   datablock)) {
+    regions=EEPROM_DIRECTIVES;
+    if (eeprom_build_regions(regions,eeprom_format(readblock),
+			     configuration_directives,NULL,
+			     eeprom_radio_parameters,readblock,datablock)) {
       fprintf(stderr,"Could not build datablock to write to EEPROM.\n");
       exit(-1);
     }
-    write_entire_eeprom(fd,datablock,readblock);    
+    regions=eeprom_changed_regions(datablock,readblock,regions);
   }
   
-  
-  if (parameters_set) {
-
-    // Read current contents
-    read_entire_eeprom(fd,readblock);
-
+  if (regions) {
     // Write new contents, using read data to suppress unnecessary writes
-    write_entire_eeprom(fd,datablock,readblock);
+    eeprom_cache_invalidate(argv[2]);
+    write_eeprom_regions(fd,datablock,readblock,regions);
   }
   
   // Verify it
   unsigned char verifyblock[2048];
-  read_entire_eeprom(fd,verifyblock);
-  int address;
   int problems=0;
-  if (parameters_set) {
-    for(address=0;address<0x800;address++) {
-      if (verifyblock[address]!=datablock[address]) problems++;
-    }
-  }
+  memcpy(verifyblock,readblock,sizeof(verifyblock));
+  if (regions)
+    problems=eeprom_verify_regions(fd,datablock,readblock,verifyblock,regions);
   
   if (problems) {
     fprintf(stderr,
 	    "ERROR: %d bytes could not be correctly written.\n"
 	    "       EEPROM data is now most likely corrupt.\n",problems);
+    read_entire_eeprom(fd,verifyblock);
     eeprom_decode_data(verifyblock,READ_ALL);
     eeprom_display_data("Datablock read from EEPROM");
     fprintf(stderr,
@@ -811,7 +1692,12 @@ int eeprom_program(int argc,char **argv)
 	    "       EEPROM data is now most likely corrupt.\n",problems);
     return -1;
   }
+  // Keep what we have seen of the other regions too, as only intact
+  // regions are kept.
+  if (regions) eeprom_cache_save(argv[2],verifyblock,EEPROM_ALL_REGIONS);
   if (parameters_show) {
+    read_entire_eeprom(fd,verifyblock);
+    eeprom_cache_save(argv[2],verifyblock,EEPROM_ALL_REGIONS);
     eeprom_decode_data(verifyblock,READ_ALL);
     eeprom_display_data("Datablock read from EEPROM");
   }
@@ -821,29 +1707,268 @@ int eeprom_program(int argc,char **argv)
   return 0;      
 }
 
+// Split a line of CSV into fields, in place.  Fields may be in double
+// quotes, with "" for a quote, so that they can hold commas.  Returns the
+// number of fields, or -1 if there are too many or a quote isn't closed.
+int eeprom_csv_fields(char *line,char **fields,int max_fields)
+{
+  int count=0;
+  char *in=line,*out=line;
+  int len=strlen(line);
+  while(len&&((line[len-1]=='\n')||(line[len-1]=='\r'))) line[--len]=0;
+  while(1) {
+    if (count>=max_fields) return -1;
+    fields[count++]=out;
+    if (*in=='"') {
+      in++;
+      while(1) {
+	if (!*in) return -1;
+	if ((in[0]=='"')&&(in[1]=='"')) { *out++='"'; in+=2; }
+	else if (*in=='"') { in++; break; }
+	else *out++=*in++;
+      }
+    } else
+      while(*in&&(*in!=',')) *out++=*in++;
+    if (*in==',') { in++; *out++=0; continue; }
+    if (*in) return -1;
+    *out=0;
+    return count;
+  }
+}
+
+// One line of a batch CSV file: the name of the unit, then the same nine
+// things that eeprom_unit_from_args() takes.
+#define EEPROM_UNIT_FIELDS 10
+struct eeprom_unit {
+  int line;
+  char *text;
+  char *fields[EEPROM_UNIT_FIELDS];
+};
+
+int eeprom_image_batch_worker(struct eeprom_unit *units,int count,
+			      int first,int step,char *out_dir)
+{
+  int failures=0,u;
+  for(u=first;u<count;u+=step) {
+    char filename[1024];
+    snprintf(filename,sizeof(filename),"%s/%s.eeprom",
+	     out_dir,units[u].fields[0]);
+    if (eeprom_image_build(&units[u].fields[1],filename)) {
+      fprintf(stderr,"line %d: Could not build EEPROM image for '%s'\n",
+	      units[u].line,units[u].fields[0]);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+// Build the EEPROM images for every unit in a CSV file, spreading them
+// across several processes, as compressing and hashing each one takes a
+// while.
+int eeprom_image_batch(char *csv_file,char *out_dir,int jobs)
+{
+  FILE *f=strcmp(csv_file,"-")?fopen(csv_file,"r"):stdin;
+  if (!f) {
+    fprintf(stderr,"Could not open '%s'\n",csv_file);
+    return -1;
+  }
+  struct eeprom_unit *units=NULL;
+  int count=0,allocated=0,line_number=0,problems=0;
+  char line[65536];
+  while(fgets(line,sizeof(line),f)) {
+    line_number++;
+    if ((!line[0])||(line[0]=='#')||(line[0]=='\n')||(line[0]=='\r'))
+      continue;
+    if (count==allocated) {
+      allocated=allocated?allocated*2:64;
+      units=realloc(units,sizeof(struct eeprom_unit)*allocated);
+      if (!units) { fprintf(stderr,"Out of memory\n"); exit(-1); }
+    }
+    struct eeprom_unit *u=&units[count];
+    u->line=line_number;
+    u->text=strdup(line);
+    int fields=eeprom_csv_fields(u->text,u->fields,EEPROM_UNIT_FIELDS);
+    // A header line names the columns
+    if ((fields>0)&&(!strcasecmp(u->fields[0],"name"))) {
+      free(u->text);
+      continue;
+    }
+    if (fields!=EEPROM_UNIT_FIELDS) {
+      fprintf(stderr,"%s:%d: Expected %d fields\n",
+	      csv_file,line_number,EEPROM_UNIT_FIELDS);
+      problems++;
+    } else if ((!u->fields[0][0])||(u->fields[0][0]=='.')
+	       ||strchr(u->fields[0],'/')) {
+      fprintf(stderr,"%s:%d: '%s' can't be used as a file name\n",
+	      csv_file,line_number,u->fields[0]);
+      problems++;
+    }
+    count++;
+  }
+  if (f!=stdin) fclose(f);
+  if (problems) return -1;
+
+  if (jobs>count) jobs=count;
+  if (jobs<1) jobs=1;
+  long long start_time=gettime_ms();
+  int failures=0;
+  if (jobs==1) failures=eeprom_image_batch_worker(units,count,0,1,out_dir);
+  else {
+    // Each process takes every jobs'th unit, and exits with how many of
+    // them it couldn't build.
+    pid_t pids[jobs];
+    int j,started=0;
+    fflush(stderr);
+    for(j=0;j<jobs;j++) {
+      pids[j]=fork();
+      if (!pids[j]) {
+	int n=eeprom_image_batch_worker(units,count,j,jobs,out_dir);
+	exit(n>255?255:n);
+      }
+      if (pids[j]<0) {
+	fprintf(stderr,"Could not start process to build EEPROM images\n");
+	break;
+      }
+      started++;
+    }
+    for(j=0;j<started;j++) {
+      int status;
+      if ((waitpid(pids[j],&status,0)!=pids[j])||(!WIFEXITED(status)))
+	failures+=(count-j+jobs-1)/jobs;
+      else failures+=WEXITSTATUS(status);
+    }
+    // Units for processes we couldn't start
+    for(;j<jobs;j++) failures+=(count-j+jobs-1)/jobs;
+  }
+  fprintf(stderr,"Built %d of %d EEPROM images in %lldms, using %d process%s.\n",
+	  count-failures,count,gettime_ms()-start_time,jobs,jobs==1?"":"es");
+
+  for(int u=0;u<count;u++) free(units[u].text);
+  free(units);
+  return failures?-1:0;
+}
+
+// Build and look at EEPROM images without a radio, so that they can be
+// made ahead of time, and then written with "flash900 eeprom <serial port>
+// image <file>".
+int eeprom_image_main(int argc,char **argv)
+{
+  if ((argc==13)&&(!strcasecmp(argv[2],"build"))) {
+    return eeprom_image_build(&argv[4],argv[3]);
+  }
+  if ((argc==4)&&(!strcasecmp(argv[2],"show"))) {
+    unsigned char datablock[2048];
+    if (eeprom_image_load(argv[3],datablock)) return -1;
+    int problems=eeprom_decode_data(datablock,READ_ALL);
+    eeprom_display_data("Datablock read from EEPROM image");
+    return problems?-1:0;
+  }
+  if (((argc==5)||(argc==6))&&(!strcasecmp(argv[2],"batch"))) {
+    int jobs=sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc==6) jobs=atoi(argv[5]);
+    if (jobs<1) { usage(); return -1; }
+    silent_mode=1;
+    return eeprom_image_batch(argv[3],argv[4],jobs);
+  }
+  usage();
+  return -1;
+}
+
+// Collect what the radio says into reply, until it has sent a whole line
+// starting with one of prefixes, or the deadline passes.  Returns the
+// offset of that line in reply, or -1.
+int eeprom_wait_for_line(int fd,char *reply,int size,int *len,
+			 char **prefixes,long long deadline)
+{
+  while(1) {
+    reply[*len]=0;
+    for(int p=0;prefixes[p];p++) {
+      char *line=strstr(reply,prefixes[p]);
+      if (line&&strchr(line,'\r')) return line-reply;
+    }
+    if (gettime_ms()>deadline) return -1;
+    int r=get_radio_reply(fd,&reply[*len],size-1-*len,0);
+    if (r>0) *len+=r;
+    else usleep(1000);
+    if (*len>=size-1) return -1;
+  }
+}
+
+// Wait for the frame with what the radio read back after writing a page,
+// and check that it is what we wrote.
+int eeprom_confirm_frame(int fd,int address,unsigned char *datablock)
+{
+  unsigned char reply[8192];
+  int len=0,o=-1;
+  long long deadline=gettime_ms()+500;
+  while(1) {
+    o=eeprom_find_frame(reply,len,EEPROM_FRAME_WRITTEN,address);
+    if (o>=0) break;
+    if (memmem(reply,len,"WRITE ERROR",11)) break;
+    if ((gettime_ms()>deadline)||(len>=sizeof(reply))) break;
+    int r=get_radio_reply(fd,(char *)&reply[len],sizeof(reply)-len,0);
+    if (r>0) len+=r;
+    else usleep(1000);
+  }
+  if (o<0) {
+    if (memmem(reply,len,"WRITE ERROR",11))
+      fprintf(stderr,"\nERROR: Write error writing to EEPROM @ 0x%x\n",address);
+    else {
+      fprintf(stderr,"\nERROR: No write confirmation received from EEPROM @ 0x%x\n",address);
+      debug++; dump_bytes("This is what I saw",reply,len); debug--;
+    }
+    return 1;
+  }
+  if (memcmp(&reply[o+4],&datablock[address],16)) {
+    fprintf(stderr,"\nERROR: EEPROM @ 0x%x read back wrong after writing\n",address);
+    debug++; dump_bytes("Read back",&reply[o+4],16); debug--;
+    return 1;
+  }
+  return 0;
+}
+
+// Ask for checksummed binary frames, if we have been told to
+int eeprom_negotiate_frames(int fd)
+{
+  char reply[1024];
+  char *eprbin[]={"EPRBIN=",NULL};
+  int len=0,version=0;
+
+  eeprom_checksummed_frames=0;
+  char *frames=getenv("FLASH900_EEPROM_FRAMES");
+  if ((!frames)||(!frames[0])||(!strcmp(frames,"0"))) return 0;
+
+  write_radio(fd,(unsigned char *)"!K",2);
+  int o=eeprom_wait_for_line(fd,reply,sizeof(reply),&len,eprbin,
+			     gettime_ms()+50);
+  eeprom_checksummed_frames=
+    (o>=0)&&(sscanf(&reply[o],"EPRBIN=%d",&version)==1)&&(version>=1);
+  if (!silent_mode)
+    fprintf(stderr,"Using %s EEPROM transfers.\n",
+	    eeprom_checksummed_frames?"checksummed binary":"plain");
+  return eeprom_checksummed_frames;
+}
+
 int eeprom_write_page(int fd, int address,unsigned char *datablock)
 {
   int problems=0;
   char cmd[1024];
-  unsigned char reply[8193];
-  int r;
+  char reply[8193];
+  int len;
 
   int address_not_yet_set=5;
   while(address_not_yet_set)
     {
       snprintf(cmd,1024,"!C%x!g",address);
       write_radio(fd,(unsigned char *)cmd,strlen(cmd));
-      usleep(15000);
-      
+
       int a,o;
-      r=read(fd,reply,8192); reply[8192]=0;
-      // debug++; dump_bytes(cmd,reply,r); debug--;
-      // Skip any other stuff
-      for(o=0;o<r;o++) if (!strncmp("EPRADDR=",(const char *)&reply[o],8)) {
-	  // fprintf(stderr,"EPRADDR= found @ offset 0x%x\n",o);
-	  break;
-	}
-      if (sscanf((const char *)&reply[o],"EPRADDR=$%x",&a)!=1) {
+      char *eepraddr[]={"EPRADDR=",NULL};
+      len=0;
+      o=eeprom_wait_for_line(fd,reply,sizeof(reply),&len,eepraddr,
+			     gettime_ms()+100);
+      // debug++; dump_bytes(cmd,reply,len); debug--;
+      if ((o<0)||(sscanf(&reply[o],"EPRADDR=$%x",&a)!=1)) {
 	// fprintf(stderr,"WARNING: Could not set EEPROM write address @ 0x%x\n",address);
       } else if (a!=address) {
 	// fprintf(stderr,"WARNING: EEPROM write address set wrong @ 0x%x (got set to 0x%x, command was '%s')\n",address,a,cmd);
@@ -855,28 +1980,24 @@ int eeprom_write_page(int fd, int address,unsigned char *datablock)
       }
     }
   
-  // Now write data bytes, escaping ! as !.
+  // Now write data bytes, escaping ! as !., followed by !y!w to write
+  // them, all in one go.
+  int cmd_len=0;
   for(int j=0;j<0x10;j++) {
-    if (datablock[address+j]=='!') write_radio(fd,(unsigned char *)"!.",2);
-    else write_radio(fd,&datablock[address+j],1);
-    // write_radio(fd,(unsigned char *)&"ABCDEFGHIJKLMNOP"[j],1);
+    if (datablock[address+j]=='!') { cmd[cmd_len++]='!'; cmd[cmd_len++]='.'; }
+    else cmd[cmd_len++]=datablock[address+j];
   }
-  usleep(1000);
-  write_radio(fd,(unsigned char *)"!y",2);
-  usleep(1000);
-  write_radio(fd,(unsigned char *)"!w",2);
-  usleep(71000);
+  memcpy(&cmd[cmd_len],"!y!w",4); cmd_len+=4;
+  write_radio(fd,(unsigned char *)cmd,cmd_len);
 
-  // Allow more time since we have slowed down I2C
-  usleep(100000);
-  
-  //  snprintf(cmd,1024,"%x!g!E",address);
-  //  write_radio(fd,(unsigned char *)cmd,strlen(cmd));
-  //  usleep(50000);
-  // Check for "EEPROM WRITTEN $%x -> $%x" or "WRITE ERROR" messages
-  
-  // clear out any queued data first
-  r=read(fd,reply,8192); reply[8192]=0;
+  // Check for "EEPROM WRITTEN $%x -> $%x" or "WRITE ERROR" messages, which
+  // take a while as we have slowed down I2C.
+  if (eeprom_checksummed_frames)
+    return problems+eeprom_confirm_frame(fd,address,datablock);
+
+  char *written[]={"READ BACK","WRITE ERROR",NULL};
+  len=0;
+  eeprom_wait_for_line(fd,reply,sizeof(reply),&len,written,gettime_ms()+500);
   char expected[1024];
   snprintf(expected,1024,"%X %X %X %X %X %X %X %X %X %X %X %X %X %X %X %X\r\r\nEEPROM WRITTEN @ $%X\r\r\nREAD BACK %X %X %X %X %X %X %X %X %X %X %X %X %X %X %X %X\r",
 	   datablock[address+0],datablock[address+1],
@@ -897,13 +2018,13 @@ int eeprom_write_page(int fd, int address,unsigned char *datablock)
 	   datablock[address+12],datablock[address+13],
 	   datablock[address+14],datablock[address+15]
 	   );
-  if (strstr((char *)reply,"WRITE ERROR")) {
+  if (strstr(reply,"WRITE ERROR")) {
     fprintf(stderr,"\nERROR: Write error writing to EEPROM @ 0x%x\n",address);
     problems++;
   }
-  if (!strstr((char *)reply,expected)) {
+  if (!strstr(reply,expected)) {
     fprintf(stderr,"\nERROR: No write confirmation received from EEPROM @ 0x%x\n",address);
-    debug++; dump_bytes("This is what I saw",reply,r); debug--;
+    debug++; dump_bytes("This is what I saw",(unsigned char *)reply,len); debug--;
     debug++; dump_bytes("I expected to see",
 			(unsigned char *)expected,strlen(expected)); debug--;
     
@@ -0,0 +1,194 @@
+/*
+  Firmware checksum kernel for flash900.
+
+  Computes the same HASH=hash1+hash2 and per-KB checksum table that the
+  radio reports in reply to !F, so that we can tell if the radio already
+  has the firmware we are about to write.
+
+  (C) Serval Project Inc. 2014.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HASH_USE_NEON
+#include <arm_neon.h>
+#endif
+#include "flash900.h"
+
+// Sum of a run of bytes.  This is where almost all of the time goes, so
+// use the SIMD sum-of-absolute-differences / pairwise-add instructions
+// where we have them.
+static uint32_t sum_bytes(const unsigned char *b,int len)
+{
+  uint32_t sum=0;
+  int i=0;
+
+#if defined(__SSE2__)
+  __m128i zero=_mm_setzero_si128();
+  __m128i acc=_mm_setzero_si128();
+  for(;i+16<=len;i+=16)
+    acc=_mm_add_epi64(acc,_mm_sad_epu8(_mm_loadu_si128((const __m128i *)&b[i]),
+				       zero));
+  sum=_mm_cvtsi128_si32(acc)+_mm_cvtsi128_si32(_mm_srli_si128(acc,8));
+#elif defined(HASH_USE_NEON)
+  uint32x4_t acc=vdupq_n_u32(0);
+  for(;i+16<=len;i+=16)
+    acc=vpadalq_u16(acc,vpaddlq_u8(vld1q_u8(&b[i])));
+  sum=vgetq_lane_u32(acc,0)+vgetq_lane_u32(acc,1)
+    +vgetq_lane_u32(acc,2)+vgetq_lane_u32(acc,3);
+#endif
+
+  for(;i<len;i++) sum+=b[i];
+  return sum;
+}
+
+// hash1 is a rotate-left-by-one then xor chain, which is inherently serial.
+// Rotation distributes over xor, so eight steps collapse into one rotate by
+// eight and one xor of the (shifted) bytes, which shortens the dependency
+// chain eight-fold without any branches.
+static uint32_t rotate_xor(uint32_t hash1,const unsigned char *b,int len)
+{
+  int i=0;
+
+  for(;i+8<=len;i+=8) {
+    uint32_t mix=(b[i+0]<<7)^(b[i+1]<<6)^(b[i+2]<<5)^(b[i+3]<<4)
+      ^(b[i+4]<<3)^(b[i+5]<<2)^(b[i+6]<<1)^b[i+7];
+    hash1=((hash1<<8)|(hash1>>24))^mix;
+  }
+  for(;i<len;i++)
+    hash1=((hash1<<1)|(hash1>>31))^b[i];
+
+  return hash1;
+}
+
+static void hash_one(const unsigned char *buffer,int start,int end,
+		     struct flash_hash *h)
+{
+  int a,j;
+
+  memset(h->checksums,0,sizeof(h->checksums));
+
+  // Bytes before the first 1KB boundary are lumped into checksums[0], which
+  // also counts the number of boundaries crossed, exactly as the radio does.
+  int first=(start+0x3ff)&~0x3ff;
+  if (first>end) first=end;
+  uint32_t s=sum_bytes(&buffer[start],first-start);
+  uint32_t hash2=2+s;
+  h->checksums[0]=s;
+
+  for(a=first,j=1;a<end;a+=0x400,j++) {
+    int len=0x400;
+    if (a+len>end) len=end-a;
+    s=sum_bytes(&buffer[a],len);
+    hash2+=s;
+    if (j<64) h->checksums[j]=s;
+    h->checksums[0]++;
+  }
+
+  for(j=0;j<64;j++) h->checksums[j]&=0xffff;
+
+  h->hash1=rotate_xor(1,&buffer[start],end-start);
+  h->hash2=hash2;
+}
+
+int calculate_hash_batch(unsigned char **buffers,int count,int start,int end,
+			 struct flash_hash *hashes)
+{
+  int i;
+  if (start<0||end<start) return -1;
+  for(i=0;i<count;i++) hash_one(buffers[i],start,end,&hashes[i]);
+  return 0;
+}
+
+// hash1 after rotating in n bytes of $FF.  Rotation distributes over xor,
+// so this is the state rotated by n, xored with rotations of $FF by 0..n-1.
+// Rotations by 32 are the identity, and each bit gets 8 of the 32 rotations
+// of $FF, which cancel out, so only n mod 32 matters.
+static uint32_t rotate_xor_fill(uint32_t hash1,unsigned int n)
+{
+  uint32_t fill=0;
+  int i,r=n&31;
+  for(i=0;i<r;i++) fill^=(0xffU<<i)|(0xffU>>((32-i)&31));
+  if (r) hash1=(hash1<<r)|(hash1>>(32-r));
+  return hash1^fill;
+}
+
+// Sum and hash1 of the bytes in [a,b) of a segment map, where unprogrammed
+// bytes read as $FF.  *i is the index of the first segment that might
+// overlap [a,b), and is left pointing at the one that might overlap what
+// follows.
+static uint32_t sum_segments(struct segment_map *map,int *i,
+			     unsigned int a,unsigned int b,uint32_t *hash1)
+{
+  uint32_t sum=0;
+  while(a<b) {
+    while((*i<map->count)&&(map->segments[*i].end<=a)) (*i)++;
+    struct segment *s=(*i<map->count)?&map->segments[*i]:NULL;
+    if (s&&(s->start<=a)) {
+      unsigned int e=s->end<b?s->end:b;
+      sum+=sum_bytes(&s->data[a-s->start],e-a);
+      *hash1=rotate_xor(*hash1,&s->data[a-s->start],e-a);
+      a=e;
+    } else {
+      unsigned int e=(s&&(s->start<b))?s->start:b;
+      sum+=0xff*(e-a);
+      *hash1=rotate_xor_fill(*hash1,e-a);
+      a=e;
+    }
+  }
+  return sum;
+}
+
+// As hash_one(), but straight from the segment map, so that we don't need
+// to assemble an image first, and gaps cost nothing.
+int calculate_hash_segments(struct segment_map *map,int start,int end,
+			    struct flash_hash *h)
+{
+  int a,j,i;
+  uint32_t hash1=1;
+
+  if (start<0||end<start) return -1;
+  memset(h->checksums,0,sizeof(h->checksums));
+
+  i=segmap_index(map,start);
+  int first=(start+0x3ff)&~0x3ff;
+  if (first>end) first=end;
+  uint32_t s=sum_segments(map,&i,start,first,&hash1);
+  uint32_t hash2=2+s;
+  h->checksums[0]=s;
+
+  for(a=first,j=1;a<end;a+=0x400,j++) {
+    int len=0x400;
+    if (a+len>end) len=end-a;
+    s=sum_segments(map,&i,a,a+len,&hash1);
+    hash2+=s;
+    if (j<64) h->checksums[j]=s;
+    h->checksums[0]++;
+  }
+
+  for(j=0;j<64;j++) h->checksums[j]&=0xffff;
+
+  h->hash1=hash1;
+  h->hash2=hash2;
+  return 0;
+}
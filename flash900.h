@@ -22,6 +22,7 @@ int clear_waiting_bytes(int fd);
 int switch_to_online_mode(int fd);
 int try_bang_B(int fd);
 int eeprom_program(int argc,char **argv);
+int eeprom_image_main(int argc,char **argv);
 int set_nonblock(int fd);
 int write_radio(int fd,unsigned char *bytes,int count);
 int get_radio_reply(int fd,char *buffer,int buffer_size,int delay_in_seconds);
@@ -34,6 +35,108 @@ void usage(void);
 
 int link_debug(char *port1,char *port2);
 
+// Firmware checksums as reported by the radio in reply to !F
+struct flash_hash {
+  unsigned int hash1;
+  unsigned int hash2;
+  unsigned int checksums[64];
+};
+
+int calculate_hash_batch(unsigned char **buffers,int count,int start,int end,
+			 struct flash_hash *hashes);
+
+// Firmware as sorted, non-overlapping runs of bytes at absolute addresses
+struct segment {
+  unsigned int start;
+  unsigned int end;
+  unsigned char *data;
+};
+struct segment_map {
+  int count;
+  struct segment *segments;
+};
+
+// A run of flash that did not read back as expected
+struct flash_range {
+  int start;
+  int end;
+  unsigned char *expected;
+};
+
+struct ihex_recordset;
+struct segment_map *segmap_new(int max_segments);
+void segmap_free(struct segment_map *map);
+struct segment_map *segmap_from_ihex(struct ihex_recordset *ihex);
+int segmap_index(struct segment_map *map,unsigned int address);
+struct segment *segmap_find(struct segment_map *map,unsigned int address);
+unsigned int segmap_covered(struct segment_map *map,
+			    unsigned int start,unsigned int end);
+void segmap_assemble(struct segment_map *map,unsigned char *buffer,
+		     unsigned int start,unsigned int end,unsigned char fill);
+int segmap_diff(struct segment_map *from,struct segment_map *to,
+		struct flash_range *ranges,int max_ranges,int join);
+struct segment_map *segmap_clip(struct segment_map *map,
+				struct segment_map *window);
+int calculate_hash_segments(struct segment_map *map,int start,int end,
+			    struct flash_hash *h);
+struct segment_map *firmware_read_window(struct segment_map *firmware,
+					 int banks);
+// Most mismatching ranges we try to patch in place, and how many matching
+// bytes may lie within one.
+#define MAX_VERIFY_RANGES 256
+#define VERIFY_RANGE_JOIN 8
+
+long long gettime_ms();
+int run_benchmarks(int argc,char **argv);
+
+// Largest flash we know of (RFD900+)
+#define FLASH_SIZE_MAX (128*1024)
+
+int fwimage_main(int argc,char **argv);
+struct ihex_recordset *fwimage_load(char *filename,int id,int freq,
+				    unsigned char **image,
+				    struct flash_hash *hash);
+struct ihex_recordset *fwimage_records(const unsigned char *table,
+				       unsigned int segments,
+				       unsigned char *data);
+void put32(unsigned char *p,unsigned int v);
+unsigned int get32(const unsigned char *p);
+struct ihex_recordset *load_compressed_ihex(char *filename,int gzip);
+
+// Firmware files available for each board and frequency id
+#define FIRMWARE_FW 0
+#define FIRMWARE_IHX_GZ 1
+#define FIRMWARE_IHX_DEFLATE 2
+#define FIRMWARE_IHX 3
+#define FIRMWARE_FORMATS 4
+// All variants in one <base>.bundle, made by "flash900 bundle"
+#define FIRMWARE_BUNDLE 4
+struct firmware_entry {
+  int id,freq;
+  int format;
+  long long mtime;  // version, as modification time of the file
+  long long size;
+  int have_hash;
+  struct flash_hash hash;
+  char path[1024];
+};
+int firmware_index_build(char *base);
+struct firmware_entry *firmware_lookup(char *base,int id,int freq);
+struct firmware_entry *firmware_lookup_next(struct firmware_entry *e);
+int firmware_entry_preferred(struct firmware_entry *e);
+extern struct firmware_entry firmware_index[];
+extern int firmware_index_count;
+struct ihex_recordset *firmware_entry_load(struct firmware_entry *e);
+int firmware_index_main(int argc,char **argv);
+
+extern char *firmware_format_suffix[FIRMWARE_FORMATS];
+int bundle_main(int argc,char **argv);
+int firmware_diff_main(int argc,char **argv);
+int bundle_entries(char *filename,struct firmware_entry *entries,int max);
+struct ihex_recordset *bundle_load(char *filename,int id,int freq,
+				   unsigned char **image,
+				   struct flash_hash *hash);
+
 
 // RFD900 boot-loader commands
 #define NOP		0x00
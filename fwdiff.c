@@ -0,0 +1,282 @@
+/*
+  Compare two firmware images, and estimate what flashing the change costs.
+
+  When we roll out a new firmware release to radios in the field, we
+  want to know beforehand whether radios running the old one can be
+  patched in place (which only works if the change only clears bits, in
+  few enough places), or will need a full erase and rewrite, and roughly
+  how long either will keep each radio off the air.  "flash900 diff
+  <old> <new>" loads both images just as load_firmware() does, lists
+  where they differ, which 1KB !F checksum buckets change, and works out
+  the time from a simple model of the serial link to the boot loader.
+  Either may be a bundle, in which case the variant compared is the one
+  for the board and frequency in the name of the other file, or given as
+  <bundle>:XX-YY.
+
+  (C) Serval Project Inc. 2014.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "cintelhex.h"
+#include "flash900.h"
+
+// The boot loader link, as set up by main()
+struct link_model {
+  int baud;
+  double latency_ms;     // USB serial round trip, on top of transfer time
+  double erase_ms;       // CHIP_ERASE
+  int addr_bytes;        // address bytes in LOAD_ADDRESS
+};
+
+static double round_trip(struct link_model *m,int out,int in)
+{
+  // 10 bits per byte, with start and stop bits
+  return (out+in)*10000.0/m->baud+m->latency_ms;
+}
+
+static double set_addr_cost(struct link_model *m)
+{
+  return round_trip(m,2+m->addr_bytes,2);
+}
+
+// write_to_flash(): 64 byte PROG_MULTI writes, waiting for each
+static double write_cost(struct link_model *m,unsigned int length)
+{
+  double ms=0;
+  while(length) {
+    int piece=length>64?64:length;
+    ms+=round_trip(m,3+piece,2);
+    length-=piece;
+  }
+  return ms;
+}
+
+// read_flash_range(): up to 4 pipelined 0xfc byte READ_MULTIs at a time,
+// 27ms apart.
+static double read_cost(struct link_model *m,struct segment_map *window)
+{
+  double ms=0;
+  int i;
+  for(i=0;i<window->count;i++) {
+    unsigned int a=window->segments[i].start,end=window->segments[i].end;
+    ms+=set_addr_cost(m);
+    while(a<end) {
+      int n,in=0;
+      for(n=0;(n<4)&&(a<end);n++) {
+	int l=(end-a<0xfc)?end-a:0xfc;
+	in+=l+2;
+	a+=l;
+      }
+      ms+=(n-1)*27.0+round_trip(m,3*n,in);
+    }
+  }
+  return ms;
+}
+
+// The board and frequency ids in a file name, either as <bundle>:XX-YY, or
+// as in the <base>-XX-YY<suffix> names that the firmware index looks for.
+// Returns the length of the name without any :XX-YY, or -1 if it has
+// neither.
+static int radio_in_name(char *filename,int *id,int *freq)
+{
+  int len=strlen(filename),n=0;
+  char *colon=strrchr(filename,':');
+  if (colon&&(sscanf(colon,":%2x-%2x%n",id,freq,&n)==2)&&(!colon[n]))
+    return colon-filename;
+  char *slash=strrchr(filename,'/'),*p;
+  for(p=slash?slash:filename;*p;p++)
+    if ((sscanf(p,"-%2x-%2x%n",id,freq,&n)==2)&&(n==6)&&(p[n]=='.'))
+      return len;
+  return -1;
+}
+
+static int is_bundle(char *filename,int len)
+{
+  return (len>7)&&(!strncmp(&filename[len-7],".bundle",7));
+}
+
+static ihex_recordset_t *load_for_diff(char *filename,int id,int freq)
+{
+  // Work out the format from the name, just as the firmware index does
+  struct firmware_entry e;
+  int file_id,file_freq;
+  int len=radio_in_name(filename,&file_id,&file_freq),format;
+  if (len<0) len=strlen(filename);
+  else { id=file_id; freq=file_freq; }
+  memset(&e,0,sizeof(e));
+  for(format=0;format<FIRMWARE_FORMATS;format++) {
+    int suffix_len=strlen(firmware_format_suffix[format]);
+    if ((len>suffix_len)
+	&&(!strncmp(&filename[len-suffix_len],firmware_format_suffix[format],
+		    suffix_len)))
+      break;
+  }
+  // Anything else we just try to read as intel hex
+  e.format=(format<FIRMWARE_FORMATS)?format:FIRMWARE_IHX;
+  if (is_bundle(filename,len)) {
+    if (id<0) {
+      fprintf(stderr,"Which radio's firmware in '%s'?  Give it as %s:XX-YY for board id XX, frequency id YY.\n",
+	      filename,filename);
+      return NULL;
+    }
+    e.format=FIRMWARE_BUNDLE;
+    e.id=id; e.freq=freq;
+  } else {
+    // Packed images for any radio will do
+    e.id=-1; e.freq=-1;
+  }
+  snprintf(e.path,sizeof(e.path),"%.*s",len,filename);
+  return firmware_entry_load(&e);
+}
+
+static int firmware_diff(char *old_file,char *new_file,struct link_model *m)
+{
+  // Bundles hold firmware for every radio, so take which one from the
+  // other file if need be.
+  int id=-1,freq=-1;
+  if (radio_in_name(new_file,&id,&freq)<0)
+    if (radio_in_name(old_file,&id,&freq)<0) id=freq=-1;
+  ihex_recordset_t *old_ihex=load_for_diff(old_file,id,freq);
+  ihex_recordset_t *new_ihex=old_ihex?load_for_diff(new_file,id,freq):NULL;
+  struct segment_map *old=old_ihex?segmap_from_ihex(old_ihex):NULL;
+  struct segment_map *new=new_ihex?segmap_from_ihex(new_ihex):NULL;
+  int fail=(!old)||(!new);
+  if ((!fail)&&old->count&&(old->segments[old->count-1].end>FLASH_SIZE_MAX)) {
+    fprintf(stderr,"'%s' contains data beyond the end of flash\n",old_file);
+    fail=1;
+  }
+  if ((!fail)&&new->count&&(new->segments[new->count-1].end>FLASH_SIZE_MAX)) {
+    fprintf(stderr,"'%s' contains data beyond the end of flash\n",new_file);
+    fail=1;
+  }
+  if (fail) {
+    segmap_free(old); segmap_free(new);
+    ihex_rs_free(old_ihex); ihex_rs_free(new_ihex);
+    return -1;
+  }
+
+  // Each range has at least one byte in it, so these can't run out
+  unsigned int new_bytes=segmap_covered(new,0,FLASH_SIZE_MAX);
+  unsigned int old_bytes=segmap_covered(old,0,FLASH_SIZE_MAX);
+  struct flash_range *changed=malloc(sizeof(struct flash_range)*(new_bytes+1));
+  struct flash_range *dropped=malloc(sizeof(struct flash_range)*(old_bytes+1));
+
+  // What has to be written, and what of the old is no longer wanted
+  int count=segmap_diff(old,new,changed,new_bytes+1,VERIFY_RANGE_JOIN);
+  int dropped_count=segmap_diff(new,old,dropped,old_bytes+1,0);
+  unsigned int changed_bytes=0,dropped_bytes=0,a;
+  int i,set_bits=0;
+  int buckets[FLASH_SIZE_MAX>>10];
+  memset(buckets,0,sizeof(buckets));
+  for(i=0;i<count;i++) {
+    struct flash_range *r=&changed[i];
+    int needs_set=0;
+    for(a=r->start;a<r->end;a++) {
+      // Flash we haven't written to reads as $FF
+      struct segment *s=segmap_find(old,a);
+      unsigned char was=s?s->data[a-s->start]:0xff;
+      unsigned char want=r->expected[a-r->start];
+      if ((was&want)!=want) needs_set=1;
+      if (was!=want) { changed_bytes++; buckets[a>>10]=1; }
+    }
+    set_bits+=needs_set;
+    printf("%s $%05x - $%05x (%d bytes)%s\n",
+	   segmap_find(old,r->start)?"Changed":"Added",
+	   r->start,r->end-1,r->end-r->start,
+	   needs_set?", needs bits set":"");
+  }
+  // Only the parts of these that the new firmware doesn't cover at all
+  for(i=0;i<dropped_count;i++)
+    for(a=dropped[i].start;a<dropped[i].end;a++)
+      if (!segmap_find(new,a)) {
+	dropped_bytes++;
+	buckets[a>>10]=1;
+      }
+  if (dropped_bytes)
+    printf("%d bytes of the old firmware are not in the new\n",dropped_bytes);
+
+  if (!count&&!dropped_bytes) printf("Firmware is identical.\n");
+  else {
+    printf("%d bytes differ in %d range%s, %s.\n",
+	   changed_bytes,count,count==1?"":"s",
+	   set_bits?"some of which need bits set":"only clearing bits");
+
+    // Only buckets 1 - 59 are compared with the radio's !F reply
+    struct flash_hash old_hash,new_hash;
+    calculate_hash_segments(old,0x400,0xf800,&old_hash);
+    calculate_hash_segments(new,0x400,0xf800,&new_hash);
+    printf("1KB checksum buckets that change:");
+    for(i=0;i<(FLASH_SIZE_MAX>>10);i++) {
+      if (!buckets[i]) continue;
+      int seen=(i>=1)&&(i<60)&&(old_hash.checksums[i]!=new_hash.checksums[i]);
+      printf(" %d%s",i,seen?"":"(unchecked)");
+    }
+    printf("\n");
+  }
+
+  // Data beyond 64KB needs 24-bit addressing
+  if (new->count&&(new->segments[new->count-1].end>0x10000)) m->addr_bytes=3;
+
+  // Both ways start by reading back what is there to compare
+  struct segment_map *window=firmware_read_window(new,FLASH_SIZE_MAX>>16);
+  double check_ms=read_cost(m,window);
+  double rewrite_ms=round_trip(m,2,2)+m->erase_ms
+    +new->count*set_addr_cost(m)+read_cost(m,window);
+  for(i=0;i<new->count;i++)
+    rewrite_ms+=write_cost(m,new->segments[i].end-new->segments[i].start);
+  printf("Estimated at %d baud, %.0fms latency, %.0fms to erase:\n",
+	 m->baud,m->latency_ms,m->erase_ms);
+  printf("  Reading flash to check = %.1fs\n",check_ms/1000);
+  printf("  Erasing and rewriting = %.1fs\n",rewrite_ms/1000);
+  // Patching in place would leave the old firmware outside the new
+  // records in flash, so a radio with other firmware is always erased.
+
+  segmap_free(window);
+  free(changed);
+  free(dropped);
+  segmap_free(old); segmap_free(new);
+  ihex_rs_free(old_ihex); ihex_rs_free(new_ihex);
+  return 0;
+}
+
+int firmware_diff_main(int argc,char **argv)
+{
+  // flash900 diff <old> <new> [<baud> [<latency ms> [<erase ms>]]]
+  if ((argc<4)||(argc>7)) {
+    usage();
+    return -1;
+  }
+  struct link_model m;
+  // main() talks to the boot loader at 230400, and FTDI serial adapters
+  // hold on to what they receive for up to 16ms.
+  m.baud=230400;
+  m.latency_ms=16;
+  m.erase_ms=1000;
+  m.addr_bytes=2;
+  if (argc>4) m.baud=atoi(argv[4]);
+  if (argc>5) m.latency_ms=atof(argv[5]);
+  if (argc>6) m.erase_ms=atof(argv[6]);
+  if (m.baud<=0) {
+    usage();
+    return -1;
+  }
+  return firmware_diff(argv[2],argv[3],&m);
+}
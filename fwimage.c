@@ -0,0 +1,308 @@
+/*
+  Pre-assembled firmware images for flash900.
+
+  Parsing intel hex, sorting and merging records, assembling the image
+  and calculating its checksums all take noticeable time on the slow
+  MIPS hosts we run on, and give the same answer every time.  So we can
+  do all of that once, with "flash900 pack", and save the result in a
+  file that can just be mapped into memory and used directly.
+
+  File layout (all fields little-endian):
+
+    0x000  "RFD900FW"
+    0x008  format version (1)
+    0x00C  board id, frequency id, 2 bytes reserved
+    0x010  image size in bytes (image starts at flash address 0)
+    0x014  number of segments
+    0x018  offset of segment table
+    0x01C  offset of image (page aligned, so that it can be mapped)
+    0x020  hash1, hash2 and 64 checksums, as per calculate_hash_batch() over
+           $0400-$F7FF, i.e., what we compare with the radio's !F reply.
+    then   segment table: start address and length of each run of data
+    then   the raw image, with unused bytes set to $FF.
+
+  (C) Serval Project Inc. 2014.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "cintelhex.h"
+#include "flash900.h"
+
+#define FWIMAGE_MAGIC "RFD900FW"
+#define FWIMAGE_VERSION 1
+#define FWIMAGE_HEADER_SIZE (0x20+4*(2+64))
+#define FWIMAGE_PAGE 4096
+
+void put32(unsigned char *p,unsigned int v)
+{
+  p[0]=v; p[1]=v>>8; p[2]=v>>16; p[3]=v>>24;
+}
+
+unsigned int get32(const unsigned char *p)
+{
+  return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+// Guess board and frequency ids from a name like firmware-4E-43.ihx
+static void ids_from_filename(char *filename,int *id,int *freq)
+{
+  char *dash=strrchr(filename,'-');
+  if (dash&&(dash-filename>=3)&&(dash[-3]=='-'))
+    sscanf(dash-2,"%02x-%02x",id,freq);
+}
+
+int fwimage_pack(char *ihx,char *out,int id,int freq)
+{
+  if (id<0||freq<0) {
+    int guess_id=0xff,guess_freq=0xff;
+    ids_from_filename(ihx,&guess_id,&guess_freq);
+    if (id<0) id=guess_id;
+    if (freq<0) freq=guess_freq;
+  }
+
+  ihex_recordset_t *ihex=ihex_rs_from_file(ihx);
+  if ((!ihex)||ihex_coalesce_records(ihex)) {
+    fprintf(stderr,"Could not read intel hex records from '%s': %s\n",
+	    ihx,ihex_error());
+    return -1;
+  }
+
+  // Work out how much flash the image covers, and list the segments
+  int i,segments=0;
+  uint32_t address_base=0,image_size=65536;
+  unsigned char *table=malloc(8*ihex->ihrs_count+8);
+  if (!table) {
+    fprintf(stderr,"Out of memory\n");
+    ihex_rs_free(ihex);
+    return -1;
+  }
+  for(i=0;i<ihex->ihrs_count;i++) {
+    ihex_record_t *r=&ihex->ihrs_records[i];
+    if (r->ihr_type==0x04)
+      address_base=(r->ihr_data[0]<<24)|(r->ihr_data[1]<<16);
+    else if (r->ihr_type==0x00) {
+      uint32_t start=address_base+r->ihr_address;
+      if (start+r->ihr_length>FLASH_SIZE_MAX) {
+	fprintf(stderr,"Intel hex file contains data beyond the end of flash ($%x)\n",
+		start+r->ihr_length);
+	ihex_rs_free(ihex); free(table);
+	return -1;
+      }
+      while (start+r->ihr_length>image_size) image_size*=2;
+      put32(&table[segments*8],start);
+      put32(&table[segments*8+4],r->ihr_length);
+      segments++;
+    }
+  }
+
+  unsigned char *image=malloc(image_size);
+  if (!image) {
+    fprintf(stderr,"Out of memory\n");
+    ihex_rs_free(ihex); free(table);
+    return -1;
+  }
+  ihex_mem_fill(image,image_size,0xff);
+  ihex_mem_copy_records(ihex,image,image_size,IHEX_WIDTH_8BIT,IHEX_ORDER_NATIVE);
+
+  struct flash_hash hash;
+  calculate_hash_batch(&image,1,0x400,0xf800,&hash);
+
+  unsigned char header[FWIMAGE_HEADER_SIZE];
+  uint32_t table_offset=FWIMAGE_HEADER_SIZE;
+  uint32_t image_offset=(table_offset+8*segments+FWIMAGE_PAGE-1)
+    &~(FWIMAGE_PAGE-1);
+  memset(header,0,sizeof(header));
+  memcpy(header,FWIMAGE_MAGIC,8);
+  put32(&header[0x08],FWIMAGE_VERSION);
+  header[0x0C]=id; header[0x0D]=freq;
+  put32(&header[0x10],image_size);
+  put32(&header[0x14],segments);
+  put32(&header[0x18],table_offset);
+  put32(&header[0x1C],image_offset);
+  put32(&header[0x20],hash.hash1);
+  put32(&header[0x24],hash.hash2);
+  for(i=0;i<64;i++) put32(&header[0x28+i*4],hash.checksums[i]);
+
+  int fail=0;
+  FILE *f=fopen(out,"w");
+  if (!f) {
+    fprintf(stderr,"Could not create '%s'\n",out);
+    fail=-1;
+  } else {
+    unsigned char pad[FWIMAGE_PAGE];
+    memset(pad,0,sizeof(pad));
+    if ((fwrite(header,sizeof(header),1,f)!=1)
+	||(segments&&(fwrite(table,8*segments,1,f)!=1))
+	||(fwrite(pad,image_offset-table_offset-8*segments,1,f)!=1)
+	||(fwrite(image,image_size,1,f)!=1))
+      fail=-1;
+    if (fclose(f)) fail=-1;
+    if (fail) fprintf(stderr,"Could not write '%s'\n",out);
+    else
+      printf("Wrote %d segments, %d byte image for board id = $%02x, freq = $%02x to '%s'\n",
+	     segments,image_size,id,freq,out);
+  }
+
+  free(image);
+  free(table);
+  ihex_rs_free(ihex);
+  return fail;
+}
+
+ihex_recordset_t *fwimage_records(const unsigned char *table,
+				   unsigned int segments,unsigned char *data)
+{
+  // Records point straight into the assembled image, whose owner must
+  // outlive them.  Segments are split at 64KB boundaries, with an extended
+  // linear address record before each new bank, just as
+  // ihex_coalesce_records() produces.
+  int count=1,i;
+  uint32_t bank=0,a;
+  for(i=0;i<segments;i++) {
+    uint32_t start=get32(&table[i*8]);
+    uint32_t end=start+get32(&table[i*8+4]);
+    for(a=start;a<end;a=(a|0xffff)+1) {
+      if ((a>>16)!=bank) { bank=a>>16; count++; }
+      count++;
+    }
+  }
+
+  ihex_recordset_t *ihex=calloc(1,sizeof(ihex_recordset_t));
+  ihex_record_t *rec=calloc(count,sizeof(ihex_record_t)+2);
+  if (!ihex||!rec) {
+    free(ihex); free(rec);
+    return NULL;
+  }
+  unsigned char *ela=(unsigned char *)&rec[count];
+  int r=0;
+  bank=0;
+  for(i=0;i<segments;i++) {
+    uint32_t start=get32(&table[i*8]);
+    uint32_t end=start+get32(&table[i*8+4]);
+    for(a=start;a<end;a=(a|0xffff)+1) {
+      uint32_t next=((a|0xffff)+1<end)?(a|0xffff)+1:end;
+      if ((a>>16)!=bank) {
+	bank=a>>16;
+	ela[0]=bank>>8; ela[1]=bank;
+	rec[r].ihr_type=IHEX_ELA;
+	rec[r].ihr_length=2;
+	rec[r].ihr_data=ela;
+	ela+=2; r++;
+      }
+      rec[r].ihr_type=IHEX_DATA;
+      rec[r].ihr_address=a&0xffff;
+      rec[r].ihr_length=next-a;
+      rec[r].ihr_data=&data[a];
+      r++;
+    }
+  }
+  rec[r].ihr_type=IHEX_EOF;
+  rec[r].ihr_data=ela;
+  r++;
+
+  ihex->ihrs_count=r;
+  ihex->ihrs_records=rec;
+  return ihex;
+}
+
+ihex_recordset_t *fwimage_load(char *filename,int id,int freq,
+			       unsigned char **image,struct flash_hash *hash)
+{
+  int fd=open(filename,O_RDONLY);
+  if (fd==-1) return NULL;
+
+  struct stat st;
+  unsigned char *map=MAP_FAILED;
+  if (!fstat(fd,&st)&&(st.st_size>=FWIMAGE_HEADER_SIZE))
+    map=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if (map==MAP_FAILED) {
+    fprintf(stderr,"Could not map firmware image '%s'\n",filename);
+    return NULL;
+  }
+
+  // Make sure that the header and segment table are sane before we trust
+  // anything in them.
+  uint32_t image_size=get32(&map[0x10]);
+  uint32_t segments=get32(&map[0x14]);
+  uint32_t table_offset=get32(&map[0x18]);
+  uint32_t image_offset=get32(&map[0x1C]);
+  char *problem=NULL;
+  int i;
+  if (memcmp(map,FWIMAGE_MAGIC,8)) problem="not a firmware image";
+  else if (get32(&map[0x08])!=FWIMAGE_VERSION) problem="unsupported version";
+  else if (((id>=0)&&(map[0x0C]!=id))||((freq>=0)&&(map[0x0D]!=freq)))
+    problem="for a different radio";
+  else if ((image_size<0xf800)||(image_size>FLASH_SIZE_MAX)
+	   ||(segments>image_size)
+	   ||(table_offset+8ULL*segments>st.st_size)
+	   ||(image_offset+(unsigned long long)image_size>st.st_size))
+    problem="truncated or corrupt";
+  for(i=0;(!problem)&&(i<segments);i++) {
+    uint32_t start=get32(&map[table_offset+i*8]);
+    uint32_t length=get32(&map[table_offset+i*8+4]);
+    if ((start>image_size)||(length>image_size-start))
+      problem="segment out of range";
+  }
+  if (problem) {
+    fprintf(stderr,"Firmware image '%s' is %s\n",filename,problem);
+    munmap(map,st.st_size);
+    return NULL;
+  }
+
+  ihex_recordset_t *ihex=fwimage_records(&map[table_offset],segments,
+					 &map[image_offset]);
+  if (!ihex) {
+    munmap(map,st.st_size);
+    return NULL;
+  }
+  ihex->ihrs_arena=map;
+  ihex->ihrs_mapped=st.st_size;
+
+  if (image) *image=&map[image_offset];
+  if (hash) {
+    hash->hash1=get32(&map[0x20]);
+    hash->hash2=get32(&map[0x24]);
+    for(i=0;i<64;i++) hash->checksums[i]=get32(&map[0x28+i*4]);
+  }
+
+  return ihex;
+}
+
+int fwimage_main(int argc,char **argv)
+{
+  // flash900 pack <firmware.ihx> <image> [<board id> <frequency id>]
+  if ((argc!=4)&&(argc!=6)) {
+    usage();
+    return -1;
+  }
+  int id=-1,freq=-1;
+  if (argc==6) {
+    id=strtol(argv[4],NULL,16);
+    freq=strtol(argv[5],NULL,16);
+  }
+  return fwimage_pack(argv[2],argv[3],id,freq);
+}
@@ -0,0 +1,310 @@
+/*
+  Index of the firmware available for each kind of radio.
+
+  Firmware for board id XX and frequency id YY lives in files called
+  <base>-XX-YY.fw, .ihx.gz, .ihx.deflate or .ihx, or else in the bundle
+  of all variants, <base>.bundle.  Rather than finding
+  out that we have nothing suitable only once the radio is sitting in
+  its bootloader, we list the directory once, up front, so that we can
+  give up while the radio is still running its old firmware, and so
+  that working out which file to use is a single lookup.
+
+  "flash900 index <base>" also records the version (modification time)
+  and the !F checksums of each image in <base>.index, so that checking
+  whether a radio is already up to date needs no firmware to be parsed
+  at all.  Index lines are only trusted while the size and modification
+  time of the file they describe are unchanged.
+
+  Every file found for a radio is kept, in order of preference, so that
+  if the preferred one turns out to be unusable once the radio is in its
+  bootloader, we can still fall back to the next.
+
+  (C) Serval Project Inc. 2014.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cintelhex.h"
+#include "flash900.h"
+
+// In order of preference, when there is more than one file for a radio
+char *firmware_format_suffix[FIRMWARE_FORMATS]={
+  ".fw",".ihx.gz",".ihx.deflate",".ihx"
+};
+
+#define MAX_FIRMWARE_ENTRIES 256
+struct firmware_entry firmware_index[MAX_FIRMWARE_ENTRIES];
+int firmware_index_count=-1;
+
+static void split_base(char *base,char *dir,int dir_len,char **prefix)
+{
+  char *slash=strrchr(base,'/');
+  if (slash) {
+    snprintf(dir,dir_len,"%.*s",(int)(slash-base),base);
+    if (!dir[0]) snprintf(dir,dir_len,"/");
+    *prefix=slash+1;
+  } else {
+    snprintf(dir,dir_len,".");
+    *prefix=base;
+  }
+}
+
+// The index is sorted by radio and then preference, so the first entry
+// for a radio is the one to use.
+static struct firmware_entry *find_entry(int id,int freq)
+{
+  int i;
+  for(i=0;i<firmware_index_count;i++)
+    if (firmware_index[i].id==id&&firmware_index[i].freq==freq)
+      return &firmware_index[i];
+  return NULL;
+}
+
+static int same_radio(struct firmware_entry *a,struct firmware_entry *b)
+{
+  return (a->id==b->id)&&(a->freq==b->freq);
+}
+
+int firmware_entry_preferred(struct firmware_entry *e)
+{
+  return (e==firmware_index)||(!same_radio(e-1,e));
+}
+
+static int compare_entries(const void *a,const void *b)
+{
+  const struct firmware_entry *x=a,*y=b;
+  if (x->id!=y->id) return x->id-y->id;
+  if (x->freq!=y->freq) return x->freq-y->freq;
+  return x->format-y->format;
+}
+
+static void read_index_file(char *base)
+{
+  char filename[1024];
+  snprintf(filename,1024,"%s.index",base);
+  FILE *f=fopen(filename,"r");
+  if (!f) return;
+
+  char line[2048];
+  while(fgets(line,sizeof(line),f)) {
+    // id freq mtime size hash1 hash2 checksums[0..63] path
+    int id,freq,n,i;
+    long long mtime,size;
+    struct flash_hash hash;
+    if (sscanf(line,"%x %x %lld %lld %x %x%n",
+	       &id,&freq,&mtime,&size,&hash.hash1,&hash.hash2,&n)!=6) continue;
+    char *p=&line[n];
+    for(i=0;i<64;i++) {
+      int used;
+      if (sscanf(p," %x%n",&hash.checksums[i],&used)!=1) break;
+      p+=used;
+    }
+    if (i<64) continue;
+    while(*p==' ') p++;
+    p[strcspn(p,"\r\n")]=0;
+
+    for(i=0;i<firmware_index_count;i++) {
+      struct firmware_entry *e=&firmware_index[i];
+      if ((e->id==id)&&(e->freq==freq)&&(!strcmp(e->path,p))
+	  &&(e->mtime==mtime)&&(e->size==size)) {
+	e->hash=hash;
+	e->have_hash=1;
+      }
+    }
+  }
+  fclose(f);
+}
+
+int firmware_index_build(char *base)
+{
+  char dir[1024],*prefix;
+  int prefix_len;
+
+  firmware_index_count=0;
+  split_base(base,dir,sizeof(dir),&prefix);
+  prefix_len=strlen(prefix);
+
+  DIR *d=opendir(dir);
+  if (!d) return -1;
+  struct dirent *de;
+  while((de=readdir(d))!=NULL) {
+    // <prefix>-XX-YY<suffix>
+    char *name=de->d_name;
+    int id,freq,format;
+    if (strncmp(name,prefix,prefix_len)) continue;
+    if (sscanf(&name[prefix_len],"-%2x-%2x",&id,&freq)!=2) continue;
+    if (name[prefix_len+3]!='-') continue;
+    for(format=0;format<FIRMWARE_FORMATS;format++)
+      if (!strcmp(&name[prefix_len+6],firmware_format_suffix[format])) break;
+    if (format==FIRMWARE_FORMATS) continue;
+
+    char path[1024];
+    struct stat st;
+    if (snprintf(path,sizeof(path),"%s/%s",dir,name)>=sizeof(path)) continue;
+    if (stat(path,&st)||!S_ISREG(st.st_mode)) continue;
+    if (firmware_index_count>=MAX_FIRMWARE_ENTRIES) continue;
+    struct firmware_entry *e=&firmware_index[firmware_index_count++];
+    strcpy(e->path,path);
+    e->id=id; e->freq=freq; e->format=format;
+    e->mtime=st.st_mtime; e->size=st.st_size;
+    e->have_hash=0;
+  }
+  closedir(d);
+
+  // The bundle comes last for every radio it has firmware for
+  char filename[1024];
+  struct firmware_entry bundled[MAX_FIRMWARE_ENTRIES];
+  snprintf(filename,1024,"%s.bundle",base);
+  int i,j,count=access(filename,R_OK)?0:
+    bundle_entries(filename,bundled,MAX_FIRMWARE_ENTRIES);
+  for(i=0;(i<count)&&(firmware_index_count<MAX_FIRMWARE_ENTRIES);i++)
+    firmware_index[firmware_index_count++]=bundled[i];
+
+  qsort(firmware_index,firmware_index_count,sizeof(struct firmware_entry),
+	compare_entries);
+
+  // A packed or compressed file made from an older build would hide a newer
+  // one.  Bundles are always made after the files that went into them, so
+  // there is no telling from them.
+  for(i=0;i<firmware_index_count;i++) {
+    struct firmware_entry *e=&firmware_index[i];
+    if (!firmware_entry_preferred(e)) continue;
+    for(j=i+1;(j<firmware_index_count)&&same_radio(e,&firmware_index[j]);j++)
+      if ((firmware_index[j].format!=FIRMWARE_BUNDLE)
+	  &&(firmware_index[j].mtime>e->mtime))
+	fprintf(stderr,"WARNING: Using '%s', although '%s' is newer.\n",
+		e->path,firmware_index[j].path);
+  }
+
+  read_index_file(base);
+  return firmware_index_count;
+}
+
+struct firmware_entry *firmware_lookup(char *base,int id,int freq)
+{
+  if (firmware_index_count<0) firmware_index_build(base);
+  return find_entry(id,freq);
+}
+
+// The next file to try for the same radio, if e can't be used
+struct firmware_entry *firmware_lookup_next(struct firmware_entry *e)
+{
+  e++;
+  if ((e<&firmware_index[firmware_index_count])&&(!firmware_entry_preferred(e)))
+    return e;
+  return NULL;
+}
+
+ihex_recordset_t *firmware_entry_load(struct firmware_entry *e)
+{
+  // Read the firmware in whatever format it is stored in, with records
+  // sorted and merged.
+  ihex_recordset_t *ihex=NULL;
+  switch(e->format) {
+  case FIRMWARE_FW: return fwimage_load(e->path,e->id,e->freq,NULL,NULL);
+  case FIRMWARE_BUNDLE: return bundle_load(e->path,e->id,e->freq,NULL,NULL);
+  case FIRMWARE_IHX_GZ: ihex=load_compressed_ihex(e->path,1); break;
+  case FIRMWARE_IHX_DEFLATE: ihex=load_compressed_ihex(e->path,0); break;
+  default: ihex=ihex_rs_from_file(e->path); break;
+  }
+  if ((!ihex)||ihex_coalesce_records(ihex)) {
+    fprintf(stderr,"Could not read intel hex records from '%s'\n",e->path);
+    ihex_rs_free(ihex);
+    return NULL;
+  }
+  return ihex;
+}
+
+// Work out the !F checksums of one firmware file
+static int hash_entry(struct firmware_entry *e)
+{
+  if (e->format==FIRMWARE_FW) {
+    // These come with their checksums
+    ihex_recordset_t *ihex=fwimage_load(e->path,e->id,e->freq,NULL,&e->hash);
+    if (!ihex) return -1;
+    ihex_rs_free(ihex);
+    e->have_hash=1;
+    return 0;
+  }
+
+  ihex_recordset_t *ihex=firmware_entry_load(e);
+  if (!ihex) return -1;
+  struct segment_map *map=segmap_from_ihex(ihex);
+  if (!map) {
+    ihex_rs_free(ihex);
+    return -1;
+  }
+  calculate_hash_segments(map,0x400,0xf800,&e->hash);
+  e->have_hash=1;
+  segmap_free(map);
+  ihex_rs_free(ihex);
+  return 0;
+}
+
+int firmware_index_main(int argc,char **argv)
+{
+  // flash900 index <firmware base>
+  if (argc!=3) {
+    usage();
+    return -1;
+  }
+  char *base=argv[2];
+  if (firmware_index_build(base)<0) {
+    fprintf(stderr,"Could not read firmware directory for '%s'\n",base);
+    return -1;
+  }
+
+  char filename[1024];
+  snprintf(filename,1024,"%s.index",base);
+  FILE *f=fopen(filename,"w");
+  if (!f) {
+    fprintf(stderr,"Could not create '%s'\n",filename);
+    return -1;
+  }
+
+  int i,j,types=0;
+  for(i=0;i<firmware_index_count;i++) {
+    struct firmware_entry *e=&firmware_index[i];
+    if (firmware_entry_preferred(e)) types++;
+    if ((!e->have_hash)&&hash_entry(e)) continue;
+    char version[64];
+    time_t mtime=e->mtime;
+    strftime(version,sizeof(version),"%Y-%m-%d %H:%M",localtime(&mtime));
+    printf("board id = $%02x, freq = $%02x : %s (%s, HASH=%08x+%08x)\n",
+	   e->id,e->freq,e->path,version,e->hash.hash1,e->hash.hash2);
+
+    fprintf(f,"%02X %02X %lld %lld %08x %08x",e->id,e->freq,
+	    e->mtime,e->size,e->hash.hash1,e->hash.hash2);
+    for(j=0;j<64;j++) fprintf(f," %x",e->hash.checksums[j]);
+    fprintf(f," %s\n",e->path);
+  }
+  if (fclose(f)) {
+    fprintf(stderr,"Could not write '%s'\n",filename);
+    return -1;
+  }
+  printf("Indexed %d firmware files for %d radio types in '%s'\n",
+	 firmware_index_count,types,filename);
+  return 0;
+}
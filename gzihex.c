@@ -0,0 +1,180 @@
+/*
+  Read intel hex firmware from gzip or raw deflate compressed files.
+
+  Intel hex is about 2.8x the size of the binary it describes, and the
+  firmware directory lives on the small flash of the Mesh Extender.  So
+  we allow firmware to be stored compressed, and inflate it a piece at a
+  time straight into the intel hex parser, without ever holding the
+  whole text in memory, or writing it to a temporary file.
+
+  (C) Serval Project Inc. 2014.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+// miniz itself is compiled in eeprom.c
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_ARCHIVE_WRITING_APIS
+#define MINIZ_HEADER_FILE_ONLY
+#include "miniz.c"
+#include "cintelhex.h"
+#include "flash900.h"
+
+#define INFLATE_CHUNK 16384
+
+// Fill as much of the buffer as we can, stopping only at end of file
+static int read_fully(int fd,unsigned char *buffer,int len)
+{
+  int got=0;
+  while(got<len) {
+    int r=read(fd,&buffer[got],len-got);
+    if (r<0&&errno==EINTR) continue;
+    if (r<0) return -1;
+    if (r==0) break;
+    got+=r;
+  }
+  return got;
+}
+
+// Length of the gzip header (RFC1952) at the start of the buffer, or -1
+// if it isn't one.
+static int gzip_header_length(unsigned char *b,int len)
+{
+  int o=10;
+  if (len<10||b[0]!=0x1f||b[1]!=0x8b||b[2]!=8) return -1;
+  int flags=b[3];
+  if (flags&0x04) {
+    // FEXTRA
+    if (o+2>len) return -1;
+    o+=2+(b[o]|(b[o+1]<<8));
+  }
+  if (flags&0x08) {
+    // FNAME
+    while(o<len&&b[o]) o++;
+    o++;
+  }
+  if (flags&0x10) {
+    // FCOMMENT
+    while(o<len&&b[o]) o++;
+    o++;
+  }
+  if (flags&0x02) o+=2; // FHCRC
+  if (o>len) return -1;
+  return o;
+}
+
+ihex_recordset_t *load_compressed_ihex(char *filename,int gzip)
+{
+  int fd=open(filename,O_RDONLY);
+  if (fd==-1) return NULL;
+
+  unsigned char in[INFLATE_CHUNK];
+  unsigned char *window=malloc(TINFL_LZ_DICT_SIZE);
+  tinfl_decompressor *inflator=malloc(sizeof(tinfl_decompressor));
+  ihex_stream_t *s=ihex_stream_new();
+  ihex_recordset_t *ihex=NULL;
+  char *problem=NULL;
+  if (!window||!inflator||!s) {
+    problem="out of memory";
+    goto done;
+  }
+  tinfl_init(inflator);
+
+  int in_len=read_fully(fd,in,sizeof(in)),in_ofs=0;
+  int eof=(in_len<(int)sizeof(in));
+  if (in_len<0) { problem="unreadable"; goto done; }
+  if (gzip) {
+    in_ofs=gzip_header_length(in,in_len);
+    if (in_ofs<0) { problem="not a gzip file"; goto done; }
+  }
+
+  mz_ulong crc=mz_crc32(0,NULL,0);
+  uint32_t total=0;
+  size_t out_ofs=0;
+  tinfl_status status;
+  do {
+    if ((in_ofs==in_len)&&(!eof)) {
+      in_len=read_fully(fd,in,sizeof(in));
+      if (in_len<0) { problem="unreadable"; goto done; }
+      eof=(in_len<(int)sizeof(in));
+      in_ofs=0;
+    }
+    size_t in_bytes=in_len-in_ofs;
+    size_t out_bytes=TINFL_LZ_DICT_SIZE-out_ofs;
+    status=tinfl_decompress(inflator,&in[in_ofs],&in_bytes,
+			    window,&window[out_ofs],&out_bytes,
+			    eof?0:TINFL_FLAG_HAS_MORE_INPUT);
+    in_ofs+=in_bytes;
+    if (status<TINFL_STATUS_DONE) { problem="corrupt or truncated"; goto done; }
+    if (out_bytes) {
+      if (ihex_stream_feed(s,(char *)&window[out_ofs],out_bytes)) {
+	problem=ihex_error();
+	goto done;
+      }
+      crc=mz_crc32(crc,&window[out_ofs],out_bytes);
+      total+=out_bytes;
+      out_ofs=(out_ofs+out_bytes)&(TINFL_LZ_DICT_SIZE-1);
+    }
+  } while(status!=TINFL_STATUS_DONE);
+
+  if (gzip) {
+    // Check the CRC32 and length in the trailer
+    // tinfl doesn't give back whole bytes left in its bit buffer when it
+    // finishes, so the start of the trailer may be in there.
+    unsigned char trailer[8];
+    int have=0;
+    int bits=inflator->m_num_bits;
+    tinfl_bit_buf_t bit_buf=inflator->m_bit_buf>>(bits&7);
+    for(;bits>=8&&have<8;bits-=8,have++,bit_buf>>=8) trailer[have]=bit_buf;
+    int n=in_len-in_ofs;
+    if (n>8-have) n=8-have;
+    memcpy(&trailer[have],&in[in_ofs],n);
+    have+=n;
+    if ((have<8)&&(read_fully(fd,&trailer[have],8-have)!=8-have)) {
+      problem="truncated";
+      goto done;
+    }
+    if ((trailer[0]|(trailer[1]<<8)|(trailer[2]<<16)|((uint32_t)trailer[3]<<24))
+	!=(uint32_t)crc
+	||(trailer[4]|(trailer[5]<<8)|(trailer[6]<<16)|((uint32_t)trailer[7]<<24))
+	!=total) {
+      problem="corrupt (CRC or length mismatch)";
+      goto done;
+    }
+  }
+
+  ihex=ihex_stream_finish(s);
+  s=NULL;
+  if (!ihex) problem=ihex_error();
+  else printf("Inflated %d bytes of intel hex from '%s'\n",total,filename);
+
+ done:
+  if (problem)
+    fprintf(stderr,"Could not read compressed intel hex file '%s': %s\n",
+	    filename,problem);
+  if (s) ihex_rs_free(ihex_stream_finish(s));
+  free(inflator);
+  free(window);
+  close(fd);
+  return ihex;
+}
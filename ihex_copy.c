@@ -40,50 +40,109 @@
 
 void ihex_set_error(ihex_error_t errno, char* error);
 
+// Byte order of the machine we are running on.
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define IHEX_HOST_ORDER IHEX_ORDER_BIGENDIAN
+#else
+#define IHEX_HOST_ORDER IHEX_ORDER_LITTLEENDIAN
+#endif
+
+/// Copy a record's data, swapping the bytes of each word if need be.
+/** Words of w bytes are converted from byte order o to that of the host.
+ *  A trailing partial word is stored as if it were padded with zeroes,
+ *  so the destination must have room for the length rounded up to a
+ *  whole word. Stores are done bytewise or through memcpy(), so neither
+ *  source nor destination need be aligned. */
+static void ihex_copy_words(uint8_t *d, const uint8_t *s, uint_t len,
+                            ihex_width_t w, ihex_byteorder_t o)
+{
+	uint_t   j = 0, l;
+	uint32_t v;
+	
+	if (w == IHEX_WIDTH_8BIT || o == IHEX_ORDER_NATIVE || o == IHEX_HOST_ORDER)
+	{
+		memcpy(d, s, len);
+		return;
+	}
+	
+	switch (w)
+	{
+		case IHEX_WIDTH_16BIT:
+			for (j = 0; j + 2 <= len; j += 2)
+			{
+				d[j]     = s[j + 1];
+				d[j + 1] = s[j];
+			}
+			break;
+		case IHEX_WIDTH_32BIT:
+			for (j = 0; j + 4 <= len; j += 4)
+			{
+				memcpy(&v, s + j, 4);
+				v = __builtin_bswap32(v);
+				memcpy(d + j, &v, 4);
+			}
+			break;
+		default:
+			for (j = 0; j + w <= len; j += w)
+			{
+				for (l = 0; l < w; l ++) d[j + l] = s[j + w - 1 - l];
+			}
+			break;
+	}
+	
+	if (j < len)
+	{
+		for (l = 0; l < w; l ++)
+		{
+			d[j + l] = (w - 1 - l < len - j) ? s[j + w - 1 - l] : 0x00;
+		}
+	}
+}
+
 int ihex_mem_copy(ihex_recordset_t *rs, void* dst, ulong_t n,
                   ihex_width_t w, ihex_byteorder_t o)
 {
-	int      r;
-	uint_t   i, j, l;
-	uint32_t offset = 0x00, address = 0x00;
-	
-	ihex_rdata_t   d = (ihex_rdata_t) dst;
-	ihex_record_t *x;
+	int r;
 	
 	if ((r = ihex_mem_zero(dst, n)) != 0)
 	{
 		return r;
 	}
 	
+	return ihex_mem_copy_records(rs, dst, n, w, o);
+}
+
+int ihex_mem_copy_records(ihex_recordset_t *rs, void* dst, ulong_t n,
+                          ihex_width_t w, ihex_byteorder_t o)
+{
+	uint_t   i;
+	uint32_t offset = 0x00, address = 0x00;
+	ulong_t  length;
+	
+	ihex_rdata_t   d = (ihex_rdata_t) dst;
+	ihex_record_t *x;
+	
 	for (i = 0; i < rs->ihrs_count; i ++)
 	{
 		x       = (rs->ihrs_records + i);
 		address = (offset + x->ihr_address);
 		
-		if (address >= n)
-		{
-			IHEX_SET_ERROR_RETURN(IHEX_ERR_ADDRESS_OUT_OF_RANGE,
-				"Address 0x%08x is out of range", address);
-		}
-		
 		switch (x->ihr_type)
 		{
 			case IHEX_DATA:
-				for (j = 0; j < x->ihr_length; j += w)
+				// Room for the whole record, rounded up to whole words.
+				length = ((x->ihr_length + w - 1) / w) * w;
+				if (address >= n || length > n - address)
 				{
-					uint32_t  v      = 0;
-					uint32_t *target = (uint32_t*) (d + address + j);
-					
-					for (l = 0; (l < w) && (j + l < x->ihr_length); l ++)
-					{
-						v += x->ihr_data[j+l] << (8 * ((o == IHEX_ORDER_BIGENDIAN) ? ((w - 1) - l) : l));
-					}
-					*(target) = v;
-					
-					#ifdef IHEX_DEBUG
-					printf("%08x -> %08x = %08x\n", address + j, v, *target);
-					#endif
+					IHEX_SET_ERROR_RETURN(IHEX_ERR_ADDRESS_OUT_OF_RANGE,
+						"Address 0x%08x is out of range", address);
 				}
+				
+				ihex_copy_words(d + address, x->ihr_data, x->ihr_length, w, o);
+				
+				#ifdef IHEX_DEBUG
+				printf("%08x -> %u bytes\n", address, x->ihr_length);
+				#endif
 				break;
 			case IHEX_EOF:
 				if (i < rs->ihrs_count - 1)
@@ -96,7 +155,7 @@ int ihex_mem_copy(ihex_recordset_t *rs, void* dst, ulong_t n,
 					return 0;
 				}
 			case IHEX_ESA:
-				offset = *(x->ihr_data) << 4;
+				offset = ((x->ihr_data[0] << 8) | x->ihr_data[1]) << 4;
 				
 				#ifdef IHEX_DEBUG
 				printf("Switched offset to 0x%08x.\n", offset);
@@ -112,6 +171,7 @@ int ihex_mem_copy(ihex_recordset_t *rs, void* dst, ulong_t n,
 				
 				break;
 			case IHEX_SSA:
+			case IHEX_SLA:
 				break;
 			default:
 				IHEX_SET_ERROR_RETURN(IHEX_ERR_UNKNOWN_RECORD_TYPE,
@@ -138,3 +198,19 @@ int ihex_mem_zero(void* dst, ulong_t n)
 	
 	return 0;
 }
+
+int ihex_mem_fill(void* dst, ulong_t n, uint8_t value)
+{
+#ifdef HAVE_MEMSET
+	memset(dst, value, n);
+#else
+	ulong_t i = 0;
+	
+	for (i = 0; i < n; i ++)
+	{
+		((uint8_t*) dst)[i] = value;
+	}
+#endif
+	
+	return 0;
+}
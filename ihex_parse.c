@@ -24,6 +24,7 @@
 
 #define IHEX_PARSE_C
 
+#include "config.h"
 #include "cintelhex.h"
 
 #include <stdio.h>
@@ -35,6 +36,12 @@
 #ifdef HAVE_SYS_MMAN_H
 #include <sys/mman.h>
 #endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define IHEX_USE_NEON
+#include <arm_neon.h>
+#endif
 
 #define IHEX_CHR_RECORDMARK 0x3A
 
@@ -47,7 +54,28 @@
 	{ IHEX_SET_ERROR(errno, error, ##__VA_ARGS__); \
 	  return errno; }
 
-static int ihex_parse_single_record(ihex_rdata_t data, unsigned int length, ihex_record_t* record);
+static int ihex_parse_single_record(ihex_rdata_t data, size_t size, unsigned int length, ihex_record_t* record, ihex_rdata_t dst);
+
+// Value of each hex digit, or 0xFF for anything that is not a hex digit.
+static const uint8_t ihex_hexval[256] =
+{
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
 
 ihex_recordset_t* ihex_rs_from_file(const char* filename)
 {
@@ -129,29 +157,30 @@ ihex_recordset_t* ihex_rs_from_file(const char* filename)
 
 ihex_recordset_t* ihex_rs_from_mem(const char* data, size_t size)
 {
-	uint_t i = 0;
-	int    r = 0, c = 0;
+	uint_t i = 0, n = 0;
+	int    r = 0;
 	const char *end = data + size;
 	
 	ihex_last_errno = 0;
 	ihex_last_error = NULL;
 
-	ihex_record_t    *rec;
+	ihex_record_t    *rec, *grown;
 	ihex_recordset_t *recls;
+	ihex_rdata_t      arena, shrunk;
+	ulong_t           used = 0;
 	
-	const char *p;
-
-	// Count number of record marks in input string.
-	for (p = data; p < end && *p != 0x00; p ++)
+	// Every data byte takes two hex digits, so half the input size is an
+	// upper bound on the total payload. All payloads are decoded into this
+	// one arena, so there is no per-record allocation. The record array is
+	// sized from a typical 16-byte record line and grown if need be.
+	uint_t c = size / 44 + 16;
+	
+	if ((arena = (ihex_rdata_t) malloc(size / 2 + 1)) == NULL)
 	{
-		if (*p == IHEX_CHR_RECORDMARK)
-		{
-			c ++;
-		}
+		IHEX_SET_ERROR(IHEX_ERR_MALLOC_FAILED, "Could not allocate memory");
+		goto malloc_arena_failed;
 	}
-	
-	// Allocate memory for the record container structure and for each
-	// individual record.
+
 	if ((rec = (ihex_record_t*) calloc(c, sizeof(ihex_record_t))) == NULL)
 	{
 		IHEX_SET_ERROR(IHEX_ERR_MALLOC_FAILED, "Could not allocate memory");
@@ -164,57 +193,221 @@ ihex_recordset_t* ihex_rs_from_mem(const char* data, size_t size)
 		goto malloc_recls_failed;
 	}
 	
-	recls->ihrs_count   = c;
-	recls->ihrs_records = rec;
+	// Skip anything before the first record mark.
+	while (data < end && *(data) != IHEX_CHR_RECORDMARK && *(data) != 0x00)
+	{
+		data ++;
+	}
 	
 	while (data < end && *(data) != 0x00)
 	{
 		i ++;
 		
 		if (data + 3 >= end) break;
-		ihex_rlen_t l = ihex_fromhex8(((ihex_rdata_t) data) + 1);
-		if (data + 9 + l * 2 >= end ||
-		    (r = ihex_parse_single_record((ihex_rdata_t) data, l, rec + i - 1)) != 0)
+		
+		if (n == c)
+		{
+			if ((grown = (ihex_record_t*) realloc(rec, 2 * c * sizeof(ihex_record_t))) == NULL)
+			{
+				IHEX_SET_ERROR(IHEX_ERR_MALLOC_FAILED, "Could not allocate memory");
+				goto parse_single_failed;
+			}
+			rec = grown;
+			c  *= 2;
+		}
+		
+		ihex_rlen_t l;
+		if (ihex_fromhex(&l, ((ihex_rdata_t) data) + 1, 1) != 1)
+		{
+			IHEX_SET_ERROR(IHEX_ERR_PARSE_ERROR, "Line %i: Invalid record length", i);
+			goto parse_single_failed;
+		}
+		// The checksum and at least a LF must be there too, as the input
+		// may be mmap()ed, so there is nothing to read past its end.
+		if (data + 11 + l * 2 >= end)
+		{
+			IHEX_SET_ERROR(IHEX_ERR_WRONG_RECORD_LENGTH, "Line %i: Incorrect record length", i);
+			goto parse_single_failed;
+		}
+		if ((r = ihex_parse_single_record((ihex_rdata_t) data, end - data, l, rec + n, arena + used)) != 0)
 		{
 			IHEX_SET_ERROR(r, "Line %i: %s", i, ihex_last_error);
 			goto parse_single_failed;
 		}
 		
-		data += (rec[i - 1].ihr_length * 2) + 10;
+		used += rec[n].ihr_length;
+		n ++;
+		
+		data += (l * 2) + 10;
 		while (data < end && *(data) != IHEX_CHR_RECORDMARK && *(data) != 0x00)
 		{
 			data ++;
 		}
 	}
 	
-	if (recls->ihrs_records[recls->ihrs_count - 1].ihr_type != IHEX_EOF)
+	if (n == 0 || rec[n - 1].ihr_type != IHEX_EOF)
 	{
 		IHEX_SET_ERROR(IHEX_ERR_NO_EOF, "Missing EOF record");
-		goto missing_eof_record;
+		goto parse_single_failed;
+	}
+	
+	// Give back what we over-allocated. Payloads were decoded in record
+	// order, so the record data pointers can simply be laid out again.
+	if ((shrunk = (ihex_rdata_t) realloc(arena, used + 1)) != NULL)
+	{
+		arena = shrunk;
+	}
+	if ((grown = (ihex_record_t*) realloc(rec, n * sizeof(ihex_record_t))) != NULL)
+	{
+		rec = grown;
 	}
+	for (used = 0, i = 0; i < n; i ++)
+	{
+		rec[i].ihr_data = arena + used;
+		used += rec[i].ihr_length;
+	}
+	
+	recls->ihrs_count   = n;
+	recls->ihrs_records = rec;
+	recls->ihrs_arena   = arena;
+	recls->ihrs_mapped  = 0;
 	
 	return recls;
 
-	missing_eof_record:
-		for (i = 0; i < recls->ihrs_count; i ++)
-		{
-			free(recls->ihrs_records[i].ihr_data);
-		}
 	parse_single_failed:
 		free(recls);
 	malloc_recls_failed:
 		free(rec);
 	malloc_rec_failed:
+		free(arena);
+	malloc_arena_failed:
 
 	return NULL;
 }
 
+ihex_stream_t* ihex_stream_new(void)
+{
+	ihex_stream_t *s;
+	
+	ihex_last_errno = 0;
+	ihex_last_error = NULL;
+	
+	if ((s = (ihex_stream_t*) calloc(1, sizeof(ihex_stream_t))) == NULL ||
+	    (s->ihs_rs = (ihex_recordset_t*) calloc(1, sizeof(ihex_recordset_t))) == NULL)
+	{
+		free(s);
+		IHEX_SET_ERROR(IHEX_ERR_MALLOC_FAILED, "Could not allocate memory");
+		return NULL;
+	}
+	
+	return s;
+}
+
+static int ihex_stream_record(ihex_stream_t* s)
+{
+	ihex_recordset_t *rs = s->ihs_rs;
+	ihex_record_t    *grown;
+	ihex_rlen_t       l;
+	int               r;
+	
+	s->ihs_line_no ++;
+	
+	if (s->ihs_eof)
+	{
+		IHEX_SET_ERROR_RETURN(IHEX_ERR_PREMATURE_EOF, "Line %i: Record after EOF record", s->ihs_line_no);
+	}
+	if (s->ihs_line_len < 11 ||
+	    ihex_fromhex(&l, (uint8_t*) s->ihs_line + 1, 1) != 1 ||
+	    s->ihs_line_len < 11 + l * 2u)
+	{
+		IHEX_SET_ERROR_RETURN(IHEX_ERR_WRONG_RECORD_LENGTH, "Line %i: Incorrect record length", s->ihs_line_no);
+	}
+	
+	if (rs->ihrs_count == s->ihs_capacity)
+	{
+		uint_t c = s->ihs_capacity ? 2 * s->ihs_capacity : 256;
+		if ((grown = (ihex_record_t*) realloc(rs->ihrs_records, c * sizeof(ihex_record_t))) == NULL)
+		{
+			IHEX_SET_ERROR_RETURN(IHEX_ERR_MALLOC_FAILED, "Could not allocate memory");
+		}
+		rs->ihrs_records = grown;
+		s->ihs_capacity  = c;
+	}
+	
+	// Records arrive one at a time, so each owns its own data.
+	ihex_rdata_t dst = (ihex_rdata_t) malloc(l + 1);
+	if (dst == NULL)
+	{
+		IHEX_SET_ERROR_RETURN(IHEX_ERR_MALLOC_FAILED, "Could not allocate memory");
+	}
+	if ((r = ihex_parse_single_record((ihex_rdata_t) s->ihs_line, s->ihs_line_len, l, rs->ihrs_records + rs->ihrs_count, dst)) != 0)
+	{
+		free(dst);
+		IHEX_SET_ERROR_RETURN(r, "Line %i: %s", s->ihs_line_no, ihex_last_error);
+	}
+	
+	if (rs->ihrs_records[rs->ihrs_count].ihr_type == IHEX_EOF) s->ihs_eof = 1;
+	rs->ihrs_count ++;
+	
+	return 0;
+}
+
+int ihex_stream_feed(ihex_stream_t* s, const char* data, size_t size)
+{
+	const char *end = data + size;
+	int         r;
+	
+	for (; data < end; data ++)
+	{
+		if (s->ihs_line_len == 0 && *data != IHEX_CHR_RECORDMARK)
+		{
+			// Skip anything between records.
+			continue;
+		}
+		if (s->ihs_line_len >= IHEX_STREAM_LINE_MAX - 2)
+		{
+			IHEX_SET_ERROR_RETURN(IHEX_ERR_WRONG_RECORD_LENGTH, "Line %i: Record too long", s->ihs_line_no + 1);
+		}
+		
+		s->ihs_line[s->ihs_line_len ++] = *data;
+		if (*data == 0x0A)
+		{
+			s->ihs_line[s->ihs_line_len] = 0;
+			if ((r = ihex_stream_record(s)) != 0) return r;
+			s->ihs_line_len = 0;
+		}
+	}
+	
+	return 0;
+}
+
+ihex_recordset_t* ihex_stream_finish(ihex_stream_t* s)
+{
+	ihex_recordset_t *rs = s->ihs_rs;
+	
+	// Allow the last record to lack its line ending.
+	if (s->ihs_line_len > 0 && ihex_stream_feed(s, "\n", 1) != 0)
+	{
+		rs = NULL;
+	}
+	else if (!s->ihs_eof)
+	{
+		IHEX_SET_ERROR(IHEX_ERR_NO_EOF, "Missing EOF record");
+		rs = NULL;
+	}
+	
+	if (rs == NULL) ihex_rs_free(s->ihs_rs);
+	free(s);
+	
+	return rs;
+}
+
 ihex_recordset_t* ihex_rs_from_string(const char* data)
 {
 	return ihex_rs_from_mem(data, strlen(data));
 }
 
-static int ihex_parse_single_record(ihex_rdata_t data, unsigned int length, ihex_record_t* record)
+static int ihex_parse_single_record(ihex_rdata_t data, size_t size, unsigned int length, ihex_record_t* record, ihex_rdata_t dst)
 {
 	uint_t i;
 	
@@ -229,38 +422,45 @@ static int ihex_parse_single_record(ihex_rdata_t data, unsigned int length, ihex
 	// 0 12 3456 78 90123456789012345678901234567890 12
 	// : 10 0100 00 214601360121470136007EFE09D21901 40
 	
-	record->ihr_length   = (ihex_rlen_t)  length;
-	record->ihr_address  = (ihex_addr_t)  ihex_fromhex16(data + 3);
-	record->ihr_type     = (ihex_rtype_t) ihex_fromhex8 (data + 7);
-	record->ihr_checksum = (ihex_rchks_t) ihex_fromhex8 (data + 9 + record->ihr_length * 2);
-
-	if ((record->ihr_data = (ihex_rdata_t) malloc(record->ihr_length)) == NULL)
+	uint8_t header[3], checksum;
+	
+	if (ihex_fromhex(header, data + 3, 3) != 3 ||
+	    ihex_fromhex(&checksum, data + 9 + length * 2, 1) != 1)
 	{
-		IHEX_SET_ERROR_RETURN(IHEX_ERR_MALLOC_FAILED, "Could not allocate memory");
+		IHEX_SET_ERROR_RETURN(IHEX_ERR_PARSE_ERROR, "Invalid hex digit in record header or checksum");
 	}
 	
-	// Records needs to end with CRLF or LF.
-	if (   (   data[11 + record->ihr_length * 2] != 0x0D
-	        || data[12 + record->ihr_length * 2] != 0x0A)
-	    && (data[11 + record->ihr_length * 2] != 0x0A))
+	record->ihr_length   = (ihex_rlen_t)  length;
+	record->ihr_address  = (ihex_addr_t)  ((header[0] << 8) | header[1]);
+	record->ihr_type     = (ihex_rtype_t) header[2];
+	record->ihr_checksum = (ihex_rchks_t) checksum;
+
+	record->ihr_data     = dst;
+	
+	// Records needs to end with CRLF or LF, within the size bytes we have.
+	size_t eol = 11 + record->ihr_length * 2;
+	if (   (   eol + 1 >= size
+	        || data[eol] != 0x0D
+	        || data[eol + 1] != 0x0A)
+	    && (eol >= size || data[eol] != 0x0A))
 	{
-		free(record->ihr_data);
 		IHEX_SET_ERROR_RETURN(IHEX_ERR_WRONG_RECORD_LENGTH, "Incorrect record length");
 	}
 	
-	for (i = 0; i < record->ihr_length; i ++)
+	if ((i = ihex_fromhex(record->ihr_data, data + 9, record->ihr_length)) != record->ihr_length)
 	{
-		if (data[9 + i*2] == 0x0A || data[9 + i*2] == 0x0D)
+		uint8_t *bad = data + 9 + i * 2;
+		if (ihex_hexval[bad[0]] <= 0x0F) bad ++;
+		
+		if (*bad == 0x0A || *bad == 0x0D)
 		{
-			free(record->ihr_data);
 			IHEX_SET_ERROR_RETURN(IHEX_ERR_WRONG_RECORD_LENGTH, "Unexpected end of line");
 		}
-		record->ihr_data[i] = ihex_fromhex8(data + 9 + i*2);
+		IHEX_SET_ERROR_RETURN(IHEX_ERR_PARSE_ERROR, "Invalid hex digit 0x%02x in data byte %i", *bad, i);
 	}
 	
 	if (ihex_check_record(record) != 0)
 	{
-		free(record->ihr_data);
 		IHEX_SET_ERROR_RETURN(IHEX_ERR_INCORRECT_CHECKSUM, "Checksum validation failed");
 	}
 	
@@ -305,10 +505,8 @@ void ihex_set_error(ihex_error_t errno, char* error)
 
 static inline uint8_t ihex_fromhex4(uint8_t i)
 {
-	if      (i >= 0x61 && i <= 0x66) return i - 0x61 + 10;
-	else if (i >= 0x41 && i <= 0x46) return i - 0x41 + 10;
-	else if (i >= 0x30 && i <= 0x39) return i - 0x30;
-	else return 0;
+	uint8_t v = ihex_hexval[i];
+	return (v > 0x0F) ? 0 : v;
 }
 
 uint8_t ihex_fromhex8(uint8_t *i)
@@ -322,30 +520,272 @@ uint16_t ihex_fromhex16(uint8_t *i)
 	       (ihex_fromhex4(i[2]) << 4) + ihex_fromhex4(i[3]);
 }
 
-void ihex_aggregate_records(ihex_recordset_t *ihex)
+#if defined(__SSE2__)
+// Turn 16 hex characters into their nibble values, flagging valid ones.
+// Bytes are compared as signed, so anything >= 0x80 lands out of range.
+static inline __m128i ihex_nibbles_sse2(__m128i c, __m128i *valid)
+{
+	__m128i d    = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i l    = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i is_d = _mm_and_si128(_mm_cmpgt_epi8(d, _mm_set1_epi8(-1)),
+	                             _mm_cmplt_epi8(d, _mm_set1_epi8(10)));
+	__m128i is_l = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8(-1)),
+	                             _mm_cmplt_epi8(l, _mm_set1_epi8(6)));
+	
+	*valid = _mm_or_si128(is_d, is_l);
+	return _mm_or_si128(_mm_and_si128(is_d, d),
+	                    _mm_and_si128(is_l, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+// Decode 32 hex characters into 16 bytes. Returns 0 if any were invalid.
+static inline int ihex_fromhex_block(uint8_t *out, const uint8_t *in)
+{
+	__m128i va, vb;
+	__m128i a = ihex_nibbles_sse2(_mm_loadu_si128((const __m128i*) in), &va);
+	__m128i b = ihex_nibbles_sse2(_mm_loadu_si128((const __m128i*) (in + 16)), &vb);
+	
+	if (_mm_movemask_epi8(_mm_and_si128(va, vb)) != 0xFFFF) return 0;
+	
+	// Each 16-bit lane holds the high nibble in its low byte.
+	__m128i mask = _mm_set1_epi16(0x00FF);
+	a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, mask), 4), _mm_srli_epi16(a, 8));
+	b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, mask), 4), _mm_srli_epi16(b, 8));
+	_mm_storeu_si128((__m128i*) out, _mm_packus_epi16(a, b));
+	return 1;
+}
+#define IHEX_HAVE_FROMHEX_BLOCK
+#elif defined(IHEX_USE_NEON)
+static inline uint8x16_t ihex_nibbles_neon(uint8x16_t c, uint8x16_t *valid)
+{
+	uint8x16_t d    = vsubq_u8(c, vdupq_n_u8('0'));
+	uint8x16_t l    = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+	uint8x16_t is_d = vcltq_u8(d, vdupq_n_u8(10));
+	uint8x16_t is_l = vcltq_u8(l, vdupq_n_u8(6));
+	
+	*valid = vorrq_u8(is_d, is_l);
+	return vorrq_u8(vandq_u8(is_d, d), vandq_u8(is_l, vaddq_u8(l, vdupq_n_u8(10))));
+}
+
+// Decode 32 hex characters into 16 bytes. Returns 0 if any were invalid.
+static inline int ihex_fromhex_block(uint8_t *out, const uint8_t *in)
 {
-  int i=0;
-  while(i<(ihex->ihrs_count-1))
-    {
-      int end_addr=ihex->ihrs_records[i].ihr_address+ihex->ihrs_records[i].ihr_length;
-      int next_start=ihex->ihrs_records[i+1].ihr_address;
-      int len=ihex->ihrs_records[i].ihr_length;
-      int next_len=ihex->ihrs_records[i+1].ihr_length;
-      if (end_addr==next_start) {
-	// Merge records
-	uint8_t *merged_record=malloc(len+next_len);
-	bcopy(ihex->ihrs_records[i].ihr_data,merged_record,len);
-	bcopy(ihex->ihrs_records[i+1].ihr_data,&merged_record[len],next_len);
-	free(ihex->ihrs_records[i].ihr_data);
-	ihex->ihrs_records[i].ihr_data=merged_record;
-	ihex->ihrs_records[i].ihr_length+=next_len;
-	// Shuffle down and remove old record.
-	ihex->ihrs_count--;
-	free(ihex->ihrs_records[i+1].ihr_data);
-	bcopy(&ihex->ihrs_records[i+2],&ihex->ihrs_records[i+1],
-	      sizeof(ihex_record_t)*(ihex->ihrs_count-i-1));
-      } else
-	i++;
-    }
-  return;
+	uint8x16_t  vh, vl;
+	uint8x16x2_t c = vld2q_u8(in); // even (high nibble) and odd characters
+	uint8x16_t  h = ihex_nibbles_neon(c.val[0], &vh);
+	uint8x16_t  l = ihex_nibbles_neon(c.val[1], &vl);
+	uint64x2_t  v = vreinterpretq_u64_u8(vandq_u8(vh, vl));
+	
+	if ((vgetq_lane_u64(v, 0) & vgetq_lane_u64(v, 1)) != ~0ULL) return 0;
+	
+	vst1q_u8(out, vorrq_u8(vshlq_n_u8(h, 4), l));
+	return 1;
+}
+#define IHEX_HAVE_FROMHEX_BLOCK
+#endif
+
+uint_t ihex_fromhex(uint8_t *out, const uint8_t *in, uint_t n)
+{
+	uint_t i = 0;
+	
+#ifdef IHEX_HAVE_FROMHEX_BLOCK
+	for (; i + 16 <= n; i += 16)
+	{
+		// On a bad digit, let the scalar loop below find exactly where.
+		if (!ihex_fromhex_block(out + i, in + 2 * i)) break;
+	}
+#endif
+	
+	for (; i < n; i ++)
+	{
+		uint8_t h = ihex_hexval[in[2 * i]];
+		uint8_t l = ihex_hexval[in[2 * i + 1]];
+		
+		if ((h | l) > 0x0F) return i;
+		out[i] = (h << 4) | l;
+	}
+	
+	return n;
+}
+
+typedef struct ihex_span {
+	uint32_t     address; //!< Absolute address, after ESA/ELA offsets.
+	uint_t       length;
+	ihex_rdata_t data;
+	uint_t       order;   //!< Position of the record in the input.
+	uint_t       segment; //!< Index of the coalesced segment it falls in.
+} ihex_span_t;
+
+typedef struct ihex_segment {
+	uint32_t start;
+	uint32_t end;
+	ulong_t  position;    //!< Offset of the segment's data in the arena.
+} ihex_segment_t;
+
+static int ihex_compare_spans(const void *a, const void *b)
+{
+	const ihex_span_t *x = a, *y = b;
+	
+	if (x->address != y->address) return (x->address < y->address) ? -1 : 1;
+	return (x->order < y->order) ? -1 : (x->order > y->order);
+}
+
+int ihex_coalesce_records(ihex_recordset_t *ihex)
+{
+	uint_t   i, n = 0, segments = 0, records = 0, r = 0;
+	uint32_t offset = 0, bank, a;
+	ulong_t  total = 0;
+	
+	ihex_span_t    *spans;
+	ihex_span_t   **by_order;
+	ihex_segment_t *seg;
+	ihex_record_t  *rec = NULL;
+	ihex_rdata_t    arena = NULL, ela;
+	
+	// One block of scratch space holds the spans, the segments and an index
+	// of spans by input position.
+	spans = (ihex_span_t*) malloc((ihex->ihrs_count + 1) *
+		(sizeof(ihex_span_t) + sizeof(ihex_segment_t) + sizeof(ihex_span_t*)));
+	if (spans == NULL)
+	{
+		IHEX_SET_ERROR_RETURN(IHEX_ERR_MALLOC_FAILED, "Could not allocate memory");
+	}
+	seg      = (ihex_segment_t*) (spans + ihex->ihrs_count + 1);
+	by_order = (ihex_span_t**) (seg + ihex->ihrs_count + 1);
+	
+	// Work out the absolute address of every data record. Offsets apply
+	// in file order, so this has to happen before any reordering.
+	for (i = 0; i < ihex->ihrs_count; i ++)
+	{
+		ihex_record_t *x = &ihex->ihrs_records[i];
+		
+		switch (x->ihr_type)
+		{
+			case IHEX_DATA:
+				if (x->ihr_length == 0) break;
+				spans[n].address = offset + x->ihr_address;
+				spans[n].length  = x->ihr_length;
+				spans[n].data    = x->ihr_data;
+				spans[n].order   = n;
+				n ++;
+				break;
+			case IHEX_ESA:
+				if (x->ihr_length >= 2) offset = ((x->ihr_data[0] << 8) | x->ihr_data[1]) << 4;
+				break;
+			case IHEX_ELA:
+				if (x->ihr_length >= 2) offset = (x->ihr_data[0] << 24) | (x->ihr_data[1] << 16);
+				break;
+			default:
+				// EOF is added back at the end. Start addresses are of no
+				// use for flash images, and are dropped.
+				break;
+		}
+	}
+	
+	// Firmware files are nearly always in order already, so only sort if
+	// we really have to.
+	for (i = 1; i < n; i ++)
+	{
+		if (spans[i].address < spans[i - 1].address) break;
+	}
+	if (i < n)
+	{
+		qsort(spans, n, sizeof(ihex_span_t), ihex_compare_spans);
+	}
+	
+	// One sweep finds each run of adjacent or overlapping records.
+	for (i = 0; i < n; i ++)
+	{
+		uint32_t end = spans[i].address + spans[i].length;
+		
+		if (segments == 0 || spans[i].address > seg[segments - 1].end)
+		{
+			seg[segments].start    = spans[i].address;
+			seg[segments].end      = end;
+			seg[segments].position = total;
+			total += spans[i].length;
+			segments ++;
+		}
+		else if (end > seg[segments - 1].end)
+		{
+			total += end - seg[segments - 1].end;
+			seg[segments - 1].end = end;
+		}
+		spans[i].segment = segments - 1;
+		by_order[spans[i].order] = &spans[i];
+	}
+	
+	// Each segment becomes one data record per 64KB bank it touches, as
+	// record addresses are only 16 bits wide, plus an extended linear
+	// address record whenever the bank changes.
+	for (bank = 0, i = 0; i < segments; i ++)
+	{
+		for (a = seg[i].start; a < seg[i].end; a = (a | 0xFFFF) + 1)
+		{
+			if ((a >> 16) != bank)
+			{
+				bank = a >> 16;
+				records ++;
+			}
+			records ++;
+		}
+	}
+	records ++;
+	
+	// All data, and the address bytes of the ELA records, share one block.
+	if ((arena = (ihex_rdata_t) malloc(total + 2 * records + 1)) == NULL ||
+	    (rec = (ihex_record_t*) calloc(records, sizeof(ihex_record_t))) == NULL)
+	{
+		free(arena);
+		free(spans);
+		IHEX_SET_ERROR_RETURN(IHEX_ERR_MALLOC_FAILED, "Could not allocate memory");
+	}
+	
+	// Copy record data in input order, so that where records overlap, the
+	// later one wins, as it would have when writing records one by one.
+	for (i = 0; i < n; i ++)
+	{
+		ihex_span_t    *x = by_order[i];
+		ihex_segment_t *g = &seg[x->segment];
+		memcpy(arena + g->position + (x->address - g->start), x->data, x->length);
+	}
+	
+	ela = arena + total;
+	for (bank = 0, i = 0; i < segments; i ++)
+	{
+		for (a = seg[i].start; a < seg[i].end; a = (a | 0xFFFF) + 1)
+		{
+			uint32_t next = ((a | 0xFFFF) + 1 < seg[i].end) ? (a | 0xFFFF) + 1 : seg[i].end;
+			
+			if ((a >> 16) != bank)
+			{
+				bank = a >> 16;
+				ela[0] = bank >> 8;
+				ela[1] = bank & 0xFF;
+				rec[r].ihr_type   = IHEX_ELA;
+				rec[r].ihr_length = 2;
+				rec[r].ihr_data   = ela;
+				ela += 2;
+				r ++;
+			}
+			rec[r].ihr_type    = IHEX_DATA;
+			rec[r].ihr_address = a & 0xFFFF;
+			rec[r].ihr_length  = next - a;
+			rec[r].ihr_data    = arena + seg[i].position + (a - seg[i].start);
+			r ++;
+		}
+	}
+	rec[r].ihr_type = IHEX_EOF;
+	rec[r].ihr_data = ela;
+	r ++;
+	
+	// Release the old records and their data.
+	ihex_rs_free_data(ihex);
+	free(ihex->ihrs_records);
+	
+	ihex->ihrs_records = rec;
+	ihex->ihrs_count   = r;
+	ihex->ihrs_arena   = arena;
+	
+	free(spans);
+	return 0;
 }
@@ -22,8 +22,13 @@
  */
 
 
+#include "config.h"
 #include "cintelhex.h"
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 ulong_t ihex_rs_get_size(ihex_recordset_t* rs)
 {
 	ulong_t s = 0;
@@ -37,13 +42,24 @@ ulong_t ihex_rs_get_size(ihex_recordset_t* rs)
 	return s;
 }
 
-void ihex_rs_free(ihex_recordset_t* rs)
+void ihex_rs_free_data(ihex_recordset_t* rs)
 {
 	uint_t i = 0;
 	
-	if (rs == NULL) return;
-	
-	if (rs->ihrs_records != NULL)
+	if (rs->ihrs_arena != NULL)
+	{
+#ifdef HAVE_MMAP
+		if (rs->ihrs_mapped)
+		{
+			munmap(rs->ihrs_arena, rs->ihrs_mapped);
+		}
+		else
+#endif
+		{
+			free(rs->ihrs_arena);
+		}
+	}
+	else if (rs->ihrs_records != NULL)
 	{
 		for (i = 0; i < rs->ihrs_count; i++)
 		{
@@ -51,6 +67,16 @@ void ihex_rs_free(ihex_recordset_t* rs)
 		}
 	}
 	
+	rs->ihrs_arena  = NULL;
+	rs->ihrs_mapped = 0;
+}
+
+void ihex_rs_free(ihex_recordset_t* rs)
+{
+	if (rs == NULL) return;
+	
+	ihex_rs_free_data(rs);
+	
 	free(rs->ihrs_records);
 	free(rs);
 }
@@ -29,6 +29,9 @@
 #include <string.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <sys/select.h>
+#include <sys/stat.h>
 #include "cintelhex.h"
 #include "flash900.h"
 
@@ -39,7 +42,12 @@ long long gettime_ms();
 long long last_write_time=0;
 long long latency=0;
 
-int verify_against_buffer(ihex_recordset_t *ihex,unsigned char *buffer, int verbose);
+int verify_against_buffer(struct segment_map *map,struct segment_map *flash,
+			  int verbose);
+int verify_ranges(struct segment_map *map,struct segment_map *flash,
+		  struct flash_range *ranges,int max_ranges);
+int repair_flash(int fd,struct flash_range *ranges,int count,
+		 unsigned char *buffer);
 
 int set_nonblock(int fd)
 {
@@ -256,148 +264,178 @@ void write_flash(int fd,unsigned char *buffer,int length)
   expect_ok(fd);
 }
 
-// Bulk read all 64KB of flash for quick comparison, and without USB serial
-// delays, and also just with higher efficiency because we can use the bandwidth
-// more efficiently.
-int read_64kb_flash(int fd,unsigned char buffer[65536])
+// Bulk read flash for quick comparison, and without USB serial delays, and
+// also just with higher efficiency because we can use the bandwidth more
+// efficiently.  buffer is indexed by flash address, so reading $10000 -
+// $10FFF fills buffer[0x10000] onwards.
+int read_flash_range(int fd,unsigned char *buffer,int start,int end)
 {
   int a;
 
-  // set read address to $0000
-  set_flash_addr(fd,0x0000);
-
-  int l=0xff;
-
-  // really only read 63KB.
-  // we pipe-line this to avoid USB serial delays, so the first read happens out
-  // here, and subsequent read commands just before reading
-
-  // We can't request all reads at once, but we can do 4 at a time.
-
-  // Read 0xfc bytes, so that we have exactly 256 reads to schedule.
-  // This makes it easier for us to pipeline things.
-  for(a=0;a<0xf800;a+=(0xfc*4)) {
-    // work out transaction length
-    l=0xfc;
+  // We pipe-line this to avoid USB serial delays: we can't request all reads
+  // at once, but we can do 4 at a time.
+  // Reads are 0xfc bytes, so that 4 of them fit in the bootloader's input.
+  // The read address only advances within a 64KB bank, so each bank needs
+  // its own LOAD_ADDRESS, and no read may straddle two banks.
+  for(a=start;a<end;) {
+    int bank_end=(a|0xffff)+1;
+    if (bank_end>end) bank_end=end;
+    set_flash_addr(fd,a);
+    while(a<bank_end) {
+      int lengths[4],n,o=a;
+      for(n=0;(n<4)&&(o<bank_end);n++) {
+	// work out transaction length
+	lengths[n]=(bank_end-o<0xfc)?bank_end-o:0xfc;
+	o+=lengths[n];
+      }
 
-    printf("\rReading $%04x - $%04x",a,a+l*4-1); fflush(stdout);
+      printf("\rReading $%05x - $%05x",a,o-1); fflush(stdout);
 
-    request_flash_read(fd,&buffer[a],l);
-    // sleep for 270 character transfers to allow read command to be fully
-    // processed, before dispatching the next, as the bootloader has no
-    // input buffer
-    usleep(270*100);
-    request_flash_read(fd,&buffer[a],l);
-    usleep(270*100);
-    request_flash_read(fd,&buffer[a],l);
-    usleep(270*100);
-    request_flash_read(fd,&buffer[a],l);
+      int i;
+      for(i=0;i<n;i++) {
+	// sleep for 270 character transfers to allow read command to be fully
+	// processed, before dispatching the next, as the bootloader has no
+	// input buffer
+	if (i) usleep(270*100);
+	request_flash_read(fd,&buffer[a],lengths[i]);
+      }
 
-    // read data
-    flash_read_requested_bytes(fd,&buffer[a],l);
-    flash_read_requested_bytes(fd,&buffer[a+1*0xfc],l);
-    flash_read_requested_bytes(fd,&buffer[a+2*0xfc],l);
-    flash_read_requested_bytes(fd,&buffer[a+3*0xfc],l);
+      // read data
+      for(i=0;i<n;i++) {
+	flash_read_requested_bytes(fd,&buffer[a],lengths[i]);
+	a+=lengths[i];
+      }
+    }
   }
 
   printf("\n");
   return 0;
-
 }
 
-void assemble_ihex(ihex_recordset_t *ihex, unsigned char buffer[65536])
+struct segment_map *firmware_read_window(struct segment_map *firmware,
+					 int banks)
 {
-  int i,j;
-  for(i=0;i<65535;i++) buffer[i]=0xff;
-
-  for(i=0;i<ihex->ihrs_count;i++)
-    if (ihex->ihrs_records[i].ihr_type==0x04) {
-      // XXX Set upper 16-bits of address
-    } else if (ihex->ihrs_records[i].ihr_type==0x00) {
-      for(j=0;j<ihex->ihrs_records[i].ihr_length;j++)
-	{
-	  buffer[ihex->ihrs_records[i].ihr_address+j]
-	    =ihex->ihrs_records[i].ihr_data[j];
-	}
-    }
-  return;
+  // The parts of flash worth reading back to check firmware: for each of
+  // the first banks 64KB banks that it has anything in, from the start of
+  // its first segment to the end of its last.  Bank 0 stops at $F800,
+  // where the boot loader starts.
+  struct segment_map *window=segmap_new(FLASH_SIZE_MAX>>16);
+  if (!window) return NULL;
+  unsigned int bank;
+  for(bank=0;(bank<banks)&&(bank<(FLASH_SIZE_MAX>>16));bank++) {
+    unsigned int bank_start=bank<<16,bank_end=(bank+1)<<16;
+    if (!bank) bank_end=0xf800;
+    int i=segmap_index(firmware,bank_start);
+    if ((i>=firmware->count)||(firmware->segments[i].start>=bank_end)) continue;
+    unsigned int start=firmware->segments[i].start,end=bank_end;
+    if (start<bank_start) start=bank_start;
+    // Unless a segment runs on past the end of the bank, stop at the end of
+    // the last one in it.
+    int last=segmap_index(firmware,bank_end);
+    if ((last>=firmware->count)||(firmware->segments[last].start>=bank_end))
+      end=firmware->segments[last-1].end;
+    window->segments[window->count].start=start;
+    window->segments[window->count].end=end;
+    window->count++;
+  }
+  return window;
 }
 
-int compare_ihex_record(const void *a,const void *b)
+struct segment_map *read_firmware_flash(int fd,struct segment_map *firmware,
+					unsigned char *buffer)
 {
-  const ihex_record_t *aa=a;
-  const ihex_record_t *bb=b;
-
-  if (aa->ihr_address<bb->ihr_address) return -1;
-  if (aa->ihr_address>bb->ihr_address) return 1;
-  return 0;
+  // Read back only the parts of flash that the firmware touches.  Without
+  // 24-bit addressing, write_to_flash() can't reach past 64KB, so neither
+  // do we.  Returns a map of what was read, pointing into buffer, which
+  // must be FLASH_SIZE_MAX bytes.
+  struct segment_map *window=
+    firmware_read_window(firmware,twentyfourbitaddressing?FLASH_SIZE_MAX>>16:1);
+  if (!window) return NULL;
+  int i;
+  for(i=0;i<window->count;i++) {
+    struct segment *s=&window->segments[i];
+    read_flash_range(fd,buffer,s->start,s->end);
+    s->data=&buffer[s->start];
+  }
+  return window;
 }
 
-ihex_recordset_t *load_firmware(char *base,int id,int freq)
+// Assembled image and checksums, if loaded from a packed firmware image
+unsigned char *firmware_image=NULL;
+struct flash_hash firmware_hash;
+
+static ihex_recordset_t *load_firmware_entry(struct firmware_entry *e,
+					     int id,int freq)
 {
-  char filename[1024];
-  snprintf(filename,1024,"%s-%02X-%02X.ihx",base,id,freq);
+  char *filename=e->path;
+
+  firmware_image=NULL;
+  if ((e->format==FIRMWARE_FW)||(e->format==FIRMWARE_BUNDLE)) {
+    ihex_recordset_t *packed=
+      (e->format==FIRMWARE_FW)?
+      fwimage_load(filename,id,freq,&firmware_image,&firmware_hash):
+      bundle_load(filename,id,freq,&firmware_image,&firmware_hash);
+    if (packed) {
+      printf("Board id = $%02x, freq = $%02x : Loaded firmware image from '%s'\n",
+	     id,freq,filename);
+      printf("(%d records in image)\n",packed->ihrs_count);
+    } else firmware_image=NULL;
+    return packed;
+  }
 
   printf("Board id = $%02x, freq = $%02x : Will load firmware from '%s'\n",
 	 id,freq,filename);
 
-  if (id==0x82) {
-    twentyfourbitaddressing=1;
-    printf("Using 24-bit addressing with this board.\n");
-  }
-
-  ihex_recordset_t *ihex=ihex_rs_from_file(filename);
+  ihex_recordset_t *ihex;
+  if (e->format==FIRMWARE_IHX_GZ) ihex=load_compressed_ihex(filename,1);
+  else if (e->format==FIRMWARE_IHX_DEFLATE) ihex=load_compressed_ihex(filename,0);
+  else ihex=ihex_rs_from_file(filename);
   if (!ihex) {
     fprintf(stderr,"Could not read intel hex records from '%s'\n",filename);
     return NULL;
   }
 
   printf("Read %d IHEX records from firmware file\n",ihex->ihrs_count);
-  ihex_aggregate_records(ihex);
-  printf("(%d records remain after aggregation)\n",ihex->ihrs_count);
 
   // Sort IHEX records into ascending address order so that when we flash
-  // them we don't mess things up by writing the flash data in the wrong order
-  qsort(ihex->ihrs_records,ihex->ihrs_count,sizeof(ihex_record_t),
-	compare_ihex_record);
+  // them we don't mess things up by writing the flash data in the wrong order,
+  // and merge them into as few segments as possible.
+  if (ihex_coalesce_records(ihex)) {
+    fprintf(stderr,"Could not aggregate intel hex records: %s\n",ihex_error());
+    ihex_rs_free(ihex);
+    return NULL;
+  }
+  printf("(%d records remain after aggregation)\n",ihex->ihrs_count);
 
   return ihex;
 }
 
-int calculate_hash(unsigned char buffer[65536],unsigned int checksums[64],
-		   int start,int end,
-		   unsigned int *h1, unsigned int *h2)
+ihex_recordset_t *load_firmware(char *base,int id,int freq)
 {
-  int i;
-
-  uint32_t hash1=1,hash2=2;
-  uint8_t hibit;
-  uint8_t	j=0;
-  for(i=start;i<end;i++) {
-    hibit=hash1>>31;
-    hash1 = hash1 << 1;
-    hash1 = hash1 ^ hibit;
-    hash1 = hash1 ^ buffer[i];
-
-    hash2 = hash2 + buffer[i];
-
-    if((i&0x3ff)==0x0) {
-      j++; if ((j<64)) checksums[j]=buffer[i];
-      checksums[0]++;
-    } else {
-      if ((j<64)) checksums[j] += buffer[i];
-    }
-
+  if (id==0x82) {
+    twentyfourbitaddressing=1;
+    printf("Using 24-bit addressing with this board.\n");
   }
 
-  for(j=0;j<64;j++) checksums[j] &= 0xffff;
-
-  printf("HASH=%08x+%08x\n",hash1,hash2);
-
-  *h1=hash1;
-  *h2=hash2;
-
-  return 0;
+  // Try the files we have for this radio in order of preference: a packed
+  // image made by "flash900 pack", compressed intel hex, plain intel hex,
+  // and then the bundle made by "flash900 bundle".  The radio may already
+  // be in its bootloader, so a file that turns out to be corrupt, truncated
+  // or for another radio is no reason to give up while there are others.
+  struct firmware_entry *e=firmware_lookup(base,id,freq);
+  if (!e) {
+    fprintf(stderr,"No firmware for board id = $%02x, freq = $%02x (looked for %s-%02X-%02X.fw, .ihx.gz, .ihx.deflate, .ihx and %s.bundle)\n",
+	    id,freq,base,id,freq,base);
+    return NULL;
+  }
+  for(;e;e=firmware_lookup_next(e)) {
+    ihex_recordset_t *ihex=load_firmware_entry(e,id,freq);
+    if (ihex) return ihex;
+    if (firmware_lookup_next(e))
+      fprintf(stderr,"Could not use '%s', so trying '%s' instead.\n",
+	      e->path,firmware_lookup_next(e)->path);
+  }
+  return NULL;
 }
 
 int write_64kb(char *filename,unsigned char *buffer)
@@ -417,76 +455,210 @@ int read_64kb(char *filename,unsigned char *buffer)
 }
 
 
-int write_to_flash(int fd,ihex_recordset_t *ihex,int writeP)
+void erase_flash(int fd)
 {
-  int max=255;
-  if (writeP) max=64;
+  unsigned char cmd[2];
+  printf("Erasing flash.\n");
+  cmd[0]=CHIP_ERASE;
+  cmd[1]=EOC;
+  write(fd,cmd,2);
+  expect_insync(fd);
+  expect_ok(fd);
+}
 
-  int address_base=0x00000000;
+int write_to_flash(int fd,struct segment_map *map)
+{
+  // Write 64 bytes at a time, with one LOAD_ADDRESS per segment.
+  // We do all writing before verification, so that we avoid additional
+  // USB serial latencies by continually adjusting the flash address.  This
+  // also allows us to verify 255 bytes at a time, instead of just 32.
+  int max=64;
+  int i,j,piece;
 
   printf("max=%d\n",max);
 
-  int i;
-  int fail=0;
-  int last_flash_address=-1;
-  for(i=0;i<ihex->ihrs_count;i++)
-    if (ihex->ihrs_records[i].ihr_type==0x04) {
-      // Set upper-16 bits of target address
-      address_base=ihex->ihrs_records[i].ihr_data[0]<<24;
-      address_base|=ihex->ihrs_records[i].ihr_data[1]<<16;
-    } else if (ihex->ihrs_records[i].ihr_type==0x00)
-      {
-	if (fail) break;
-
-	if ((ihex->ihrs_records[i].ihr_address+ihex->ihrs_records[i].ihr_length)
-	    >=0xfc00) {
-	  fprintf(stderr,"\nWARNING: Intel hex file contains out of bound data ($%02x-$%04x)\n",
-		  ihex->ihrs_records[i].ihr_address,
-		  ihex->ihrs_records[i].ihr_address+ihex->ihrs_records[i].ihr_length);
-	}
+  for(i=0;i<map->count;i++) {
+    struct segment *s=&map->segments[i];
+    int length=s->end-s->start;
 
-	int j;
-	// write 32 bytes at a time.
-	// (but do all writing before verification, so that we avoid additional
-	// USB serial latencies by continually adjusting the flash address.  This
-	// also allows us to verify 255 bytes at a time, instead of just 32.)
-	if (writeP) {
-	  if (last_flash_address!=ihex->ihrs_records[i].ihr_address) {
-	    set_flash_addr(fd,ihex->ihrs_records[i].ihr_address);
-	    last_flash_address=ihex->ihrs_records[i].ihr_address;
-	  }
-	  for(j=0;j<ihex->ihrs_records[i].ihr_length;j+=max)
-	    {
-	      // work out how big this piece is
-	      int length=max;
-	      if (j+length>ihex->ihrs_records[i].ihr_length) {
-		// printf("  clipping read from $%02x\n",length);
-		length=ihex->ihrs_records[i].ihr_length-j;
-	      }
-
-	      printf("\rWrite $%04x - $%04x (len=$%02x)     \r",
-		     ihex->ihrs_records[i].ihr_address+j,
-		     ihex->ihrs_records[i].ihr_address+j+length-1,length);
-	      fflush(stdout);
-
-	      // Write to flash
-	      write_flash_async(fd,&ihex->ihrs_records[i].ihr_data[j],length);
-	      expect_insync(fd); expect_ok(fd);
-	      last_flash_address+=length;
-	    }
-	}
-      }
+    if ((s->start<0x10000)&&(s->end>=0xfc00)) {
+      fprintf(stderr,"\nWARNING: Intel hex file contains out of bound data ($%02x-$%04x)\n",
+	      s->start,s->end);
+    }
+
+    if ((s->end>0x10000)&&(!twentyfourbitaddressing)) {
+      fprintf(stderr,"\nWARNING: Skipping data above 64KB ($%x-$%x), as this board only has 16-bit addressing\n",
+	      s->start<0x10000?0x10000:s->start,s->end-1);
+      if (s->start>=0x10000) continue;
+      length=0x10000-s->start;
+    }
+
+    set_flash_addr(fd,s->start);
+    for(j=0;j<length;j+=piece) {
+      // work out how big this piece is, and start each 64KB bank afresh
+      piece=max;
+      if (j+piece>length) piece=length-j;
+      if (((s->start+j)>>16)!=((s->start+j+piece-1)>>16))
+	piece=0x10000-((s->start+j)&0xffff);
+      else if (j&&!((s->start+j)&0xffff))
+	set_flash_addr(fd,s->start+j);
+
+      printf("\rWrite $%04x - $%04x (len=$%02x)     \r",
+	     s->start+j,s->start+j+piece-1,piece);
+      fflush(stdout);
+
+      // Write to flash
+      write_flash_async(fd,&s->data[j],piece);
+      expect_insync(fd); expect_ok(fd);
+    }
+  }
   printf("\n");
-  if (fail) {
-    if (writeP) {
-      write(fd,"0",1);
-      exit(-4);
+  return 0;
+}
+
+// Read and parse whatever firmware input is ready, without blocking.
+// Returns 1 once the input is exhausted.
+int stream_input(int in_fd,ihex_stream_t *stream)
+{
+  char buffer[4096];
+  int r=read(in_fd,buffer,sizeof(buffer));
+  if (r==0) return 1;
+  if (r<0) {
+    if (errno==EAGAIN||errno==EINTR) return 0;
+    fprintf(stderr,"\nERROR: Could not read firmware input.\n");
+    return -1;
+  }
+  if (ihex_stream_feed(stream,buffer,r)) {
+    fprintf(stderr,"\nERROR: Bad intel hex input: %s\n",ihex_error());
+    return -1;
+  }
+  return 0;
+}
+
+// Wait until fd has something for us to read, parsing firmware input that
+// turns up in the meantime, so that parsing overlaps flash programming.
+int stream_while_waiting(int fd,int in_fd,ihex_stream_t *stream,int *done)
+{
+  while(1) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd,&fds);
+    if (!*done) FD_SET(in_fd,&fds);
+    int max=(fd>in_fd)?fd:in_fd;
+    if (select(max+1,&fds,NULL,NULL,NULL)<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    if ((!*done)&&FD_ISSET(in_fd,&fds)) {
+      int r=stream_input(in_fd,stream);
+      if (r<0) return -1;
+      if (r) *done=1;
     }
-    else return -1;
+    if (FD_ISSET(fd,&fds)) return 0;
   }
+}
+
+int stream_flush(int fd,int in_fd,ihex_stream_t *stream,int *done,
+		 int address,unsigned char *data,int length,
+		 int *last_flash_address)
+{
+  if (!length) return 0;
+  // Start each 64KB bank afresh, as write_to_flash() does
+  if ((*last_flash_address!=address)||!(address&0xffff))
+    set_flash_addr(fd,address);
+  printf("\rWrite $%04x - $%04x (len=$%02x)     \r",
+	 address,address+length-1,length);
+  fflush(stdout);
+  write_flash_async(fd,data,length);
+  if (stream_while_waiting(fd,in_fd,stream,done)) return -1;
+  expect_insync(fd); expect_ok(fd);
+  *last_flash_address=address+length;
   return 0;
 }
 
+// Write firmware to flash as it arrives on in_fd, e.g., from a pipe.
+// Contiguous data is gathered into full PROG_MULTI writes, and input is
+// parsed while each write is being programmed.  Returns all the records
+// received, for verification, or exits if the input is bad.
+ihex_recordset_t *stream_to_flash(int fd,int in_fd)
+{
+  ihex_stream_t *stream=ihex_stream_new();
+  if (!stream) exit(-4);
+  set_nonblock(in_fd);
+
+  int done=0,next=0,last_flash_address=-1,address_base=0;
+  int pending_address=0,pending_length=0,skipped_high=0;
+  unsigned char pending[64];
+
+  while(1) {
+    if (next<stream->ihs_rs->ihrs_count) {
+      // Queue up the next record.  Copy what we need, as the record array
+      // can move when more input is parsed.
+      ihex_record_t r=stream->ihs_rs->ihrs_records[next++];
+      int j;
+      if (r.ihr_type==IHEX_ELA) {
+	address_base=(r.ihr_data[0]<<24)|(r.ihr_data[1]<<16);
+	continue;
+      }
+      if (r.ihr_type==IHEX_ESA) {
+	address_base=((r.ihr_data[0]<<8)|r.ihr_data[1])<<4;
+	continue;
+      }
+      if (r.ihr_type!=IHEX_DATA) continue;
+      for(j=0;j<r.ihr_length;j++) {
+	int address=address_base+r.ihr_address+j;
+	if ((address>=0x10000)&&(!twentyfourbitaddressing)) {
+	  if (!skipped_high)
+	    fprintf(stderr,"\nWARNING: Skipping data above 64KB (from $%x), as this board only has 16-bit addressing\n",
+		    address);
+	  skipped_high=1;
+	  continue;
+	}
+	// Writes can't cross into the next 64KB bank
+	if (pending_length&&((pending_address+pending_length!=address)
+			     ||(pending_length==sizeof(pending))
+			     ||!(address&0xffff))) {
+	  if (stream_flush(fd,in_fd,stream,&done,pending_address,
+			   pending,pending_length,&last_flash_address)) break;
+	  pending_length=0;
+	}
+	if (!pending_length) pending_address=address;
+	pending[pending_length++]=r.ihr_data[j];
+      }
+      if (j<r.ihr_length) break;
+    } else if (done) {
+      break;
+    } else {
+      // Nothing to write yet, so wait for more input.
+      int r;
+      fd_set fds;
+      FD_ZERO(&fds);
+      FD_SET(in_fd,&fds);
+      select(in_fd+1,&fds,NULL,NULL,NULL);
+      r=stream_input(in_fd,stream);
+      if (r<0) break;
+      if (r) done=1;
+    }
+  }
+  if ((!done)||(next<stream->ihs_rs->ihrs_count)
+      ||stream_flush(fd,in_fd,stream,&done,pending_address,
+		     pending,pending_length,&last_flash_address)) {
+    fprintf(stderr,"\nERROR: Could not write streamed firmware.\n");
+    write(fd,"0",1);
+    exit(-4);
+  }
+  printf("\n");
+
+  ihex_recordset_t *ihex=ihex_stream_finish(stream);
+  if ((!ihex)||ihex_coalesce_records(ihex)) {
+    fprintf(stderr,"ERROR: Streamed firmware is incomplete: %s\n",ihex_error());
+    write(fd,"0",1);
+    exit(-4);
+  }
+  printf("Streamed %d IHEX records to flash\n",ihex->ihrs_count);
+  return ihex;
+}
+
 long long gettime_ms()
 {
   struct timeval nowtv;
@@ -509,6 +681,10 @@ int id=0xff;
 int freq=0xff;
 unsigned int hash1=1;
 ihex_recordset_t *ihex=NULL;
+// The firmware's segments, for writing, verifying and hashing
+struct segment_map *firmware_map=NULL;
+// Firmware input to write as it arrives, or -1 to load it from a file
+int stream_fd=-1;
 
 int exit_speed=0;
 
@@ -553,14 +729,42 @@ int check_bang_f_reply(int fd,unsigned char *reply,int r,char *firmwarefile)
     printf("Successfully parsed HASH response.\n");
     if (first_speed==-1) first_speed=detectedspeed;
     ret_code=1;
+
+    if (stream_fd>=0) {
+      // We only get to see streamed firmware once, as we write it.
+      printf("Firmware is being streamed, so can't compare checksums: will reflash.\n");
+      force=1;
+      return ret_code;
+    }
     
-    ihex=load_firmware(firmwarefile,id,freq);
-    
-    unsigned int newhash1,newhash2;
-    unsigned char ibuffer[65536];
+    // Give up now if we have no firmware for this radio, rather than
+    // once it is stuck in the bootloader.
+    struct firmware_entry *e=firmware_lookup(firmwarefile,id,freq);
+    if (!e) {
+      fprintf(stderr,"Sorry, I don't have firmware for your model of radio (board id = $%02x, freq = $%02x).  Leaving it as it is.\n",id,freq);
+      reset_speed_and_exit(fd,-2);
+    }
+
     unsigned int ichecksums[64];
-    assemble_ihex(ihex,ibuffer);
-    calculate_hash(ibuffer,ichecksums,0x400,0xf800,&newhash1,&newhash2);
+    if (e->have_hash) {
+      // "flash900 index" has already calculated the checksums
+      memcpy(ichecksums,e->hash.checksums,sizeof(ichecksums));
+      printf("HASH=%08x+%08x (from index)\n",e->hash.hash1,e->hash.hash2);
+    } else if ((ihex=load_firmware(firmwarefile,id,freq))==NULL) {
+      fprintf(stderr,"Could not load firmware for your radio.  Leaving it as it is.\n");
+      reset_speed_and_exit(fd,-2);
+    } else if (firmware_image) {
+      // Packed images come with their checksums already calculated
+      memcpy(ichecksums,firmware_hash.checksums,sizeof(ichecksums));
+      printf("HASH=%08x+%08x\n",firmware_hash.hash1,firmware_hash.hash2);
+    } else {
+      struct flash_hash h;
+      struct segment_map *map=segmap_from_ihex(ihex);
+      calculate_hash_segments(map,0x400,0xf800,&h);
+      segmap_free(map);
+      printf("HASH=%08x+%08x\n",h.hash1,h.hash2);
+      memcpy(ichecksums,h.checksums,sizeof(ichecksums));
+    }
     
     // Only check the first 60KB, as the rest is bootloader and other stuff
     // that we can't rely upon.  This leaves the chance of some possible changes
@@ -621,6 +825,36 @@ int main(int argc,char **argv)
       return eeprom_program(argc,argv);
     }
 
+  if (argc>1)
+    if (!strcmp(argv[1],"eeprom-image")) {
+      return eeprom_image_main(argc,argv);
+    }
+
+  if (argc>1)
+    if (!strcmp(argv[1],"bench")) {
+      return run_benchmarks(argc,argv);
+    }
+
+  if (argc>1)
+    if (!strcmp(argv[1],"pack")) {
+      return fwimage_main(argc,argv);
+    }
+
+  if (argc>1)
+    if (!strcmp(argv[1],"index")) {
+      return firmware_index_main(argc,argv);
+    }
+
+  if (argc>1)
+    if (!strcmp(argv[1],"bundle")) {
+      return bundle_main(argc,argv);
+    }
+
+  if (argc>1)
+    if (!strcmp(argv[1],"diff")) {
+      return firmware_diff_main(argc,argv);
+    }
+
 
   if ((argc<3|| argc>4)
       ||(argc==4&&(strcasecmp(argv[3],"force")
@@ -637,6 +871,26 @@ int main(int argc,char **argv)
 
   if (argc==4) exit_speed=atoi(argv[3]);
 
+  // Firmware can be piped in, either on stdin, or via a named pipe
+  {
+    struct stat st;
+    if (!strcmp(argv[1],"-")) stream_fd=0;
+    else if ((!stat(argv[1],&st))&&S_ISFIFO(st.st_mode)) {
+      stream_fd=open(argv[1],O_RDONLY);
+      if (stream_fd==-1) {
+	fprintf(stderr,"Could not open firmware pipe '%s'\n",argv[1]);
+	exit(-1);
+      }
+    }
+    if (stream_fd>=0) {
+      if (verify) {
+	fprintf(stderr,"Can't verify against streamed firmware.\n");
+	exit(-1);
+      }
+      force=1;
+    }
+  }
+
   int fd=open(argv[2],O_RDWR);
   if (fd==-1) {
     fprintf(stderr,"Could not open serial port '%s'\n",argv[2]);
@@ -720,8 +974,16 @@ int main(int argc,char **argv)
   expect_insync(fd);
   expect_ok(fd);
 
-  ihex=load_firmware(argv[1],id,freq);
-  if (!ihex) {
+  if (stream_fd>=0) {
+    printf("Board id = $%02x, freq = $%02x : Will write firmware as it arrives\n",
+	   id,freq);
+    if (id==0x82) {
+      twentyfourbitaddressing=1;
+      printf("Using 24-bit addressing with this board.\n");
+    }
+  } else
+    ihex=load_firmware(argv[1],id,freq);
+  if ((stream_fd<0)&&(!ihex)) {
 
     fprintf(stderr,"Sorry, I don't have firmware for your model of radio.  Your radio is probably stuck in bootloader mode now, until you find another way to update it.\n");
 
@@ -730,6 +992,11 @@ int main(int argc,char **argv)
 
     reset_speed_and_exit(fd,-2);
   }
+  if ((stream_fd<0)&&((firmware_map=segmap_from_ihex(ihex))==NULL)) {
+    fprintf(stderr,"Could not map firmware segments: %s\n",ihex_error());
+    write(fd,"0",1);
+    reset_speed_and_exit(fd,-2);
+  }
 
 
   // Reset parameters
@@ -744,26 +1011,26 @@ int main(int argc,char **argv)
   // Program all parts of the firmware and verify that that got written
   printf("Checking if the radio already has this version of firmware...\n");
 
-  /*
-    XXX - We only support 64KB of flash, even though the RFD900+ has 128KB
-  */
+  // Flash read back from the radio, indexed by address, covering both
+  // 64KB banks of the RFD900+.
+  static unsigned char buffer[FLASH_SIZE_MAX];
 
   if (!force) {
     // read flash and compare with ihex records
-    unsigned char buffer[65536];
     printf("Bulk reading from flash...\n");
-    read_64kb_flash(fd,buffer);
+    struct segment_map *flash=read_firmware_flash(fd,firmware_map,buffer);
     read_time=gettime_ms()-lap_time; lap_time=gettime_ms();
-    // write_64kb("fromradio.bin",buffer);
-    printf("Read all 64KB flash. Now verifying...\n");
-    unsigned int newhash1,newhash2;
-    unsigned char ibuffer[65536];
-    unsigned int ichecksums[64];
-    assemble_ihex(ihex,ibuffer);
-    // write_64kb("fromhex.bin",ibuffer);
-    calculate_hash(ibuffer,ichecksums,start,end,&newhash1,&newhash2);
-
-    fail=verify_against_buffer(ihex,buffer,1);
+    printf("Read %d bytes of flash. Now verifying...\n",
+	   segmap_covered(flash,0,FLASH_SIZE_MAX));
+    struct flash_hash h;
+    calculate_hash_segments(firmware_map,start,end,&h);
+    printf("HASH=%08x+%08x\n",h.hash1,h.hash2);
+
+    // A radio holding different firmware always gets erased, even if the
+    // new records only need bits cleared, as otherwise what the old firmware
+    // has outside them stays behind, and !F never matches again.
+    fail=verify_against_buffer(firmware_map,flash,1);
+    segmap_free(flash);
   }
   if ((force||fail)&&(!verify))
     {
@@ -771,25 +1038,34 @@ int main(int argc,char **argv)
 
       lap_time=gettime_ms();
 
-      // Erase ROM
-      printf("Erasing flash.\n");
-      cmd[0]=CHIP_ERASE;
-      cmd[1]=EOC;
-      write(fd,cmd,2);
-      expect_insync(fd);
-      expect_ok(fd);
-
-      // Write ROM
+      // Erase and write ROM
+      erase_flash(fd);
       printf("Flash erased, now writing new firmware.\n");
-      write_to_flash(fd,ihex,1);
+      if (stream_fd>=0) {
+	ihex=stream_to_flash(fd,stream_fd);
+	firmware_map=segmap_from_ihex(ihex);
+      } else write_to_flash(fd,firmware_map);
       write_time=gettime_ms()-lap_time; lap_time=gettime_ms();
 
       if (!fast) {
-	// Verify that we wrote it correctly
-	unsigned char buffer[65536];
+	// Verify that we wrote it correctly.  A few bad bytes get patched up
+	// in place, and we only start over if that can't be done.
+	struct flash_range ranges[MAX_VERIFY_RANGES];
 	printf("Verifying new firmware.\n");
-	read_64kb_flash(fd,buffer);
-	verify_against_buffer(ihex,buffer,1);
+	struct segment_map *flash=read_firmware_flash(fd,firmware_map,buffer);
+	int count=verify_ranges(firmware_map,flash,ranges,MAX_VERIFY_RANGES);
+	if (count) {
+	  verify_against_buffer(firmware_map,flash,1);
+	  if ((count<0)||repair_flash(fd,ranges,count,buffer)) {
+	    printf("Could not repair flash in place: erasing and writing again.\n");
+	    erase_flash(fd);
+	    write_to_flash(fd,firmware_map);
+	    segmap_free(flash);
+	    flash=read_firmware_flash(fd,firmware_map,buffer);
+	    verify_against_buffer(firmware_map,flash,1);
+	  }
+	}
+	segmap_free(flash);
       }
       verify_time=gettime_ms()-lap_time; lap_time=gettime_ms();
 
@@ -811,10 +1087,9 @@ int main(int argc,char **argv)
   return 0;
 }
 
-int verify_against_buffer(ihex_recordset_t *ihex,unsigned char *buffer, int verbose)
+int verify_against_buffer(struct segment_map *map,struct segment_map *flash,
+			  int verbose)
 {
-  int i;
-
   // Only check $0000-$F7FD, as the rest is boot loader or other stuff.
   // (Is $F7FE-$F7FF for non-volatile variable storage or something?
   // it seems to never be set right after restart, but verifies back fine
@@ -824,37 +1099,105 @@ int verify_against_buffer(ihex_recordset_t *ihex,unsigned char *buffer, int verb
   // So we are stuck with this, until we can add commands to our CSMA firmware to
   // allow reading of FLASH memory without entering the bootloader.
 
-  int fail=0;
+  struct flash_range ranges[MAX_VERIFY_RANGES];
+  int count=verify_ranges(map,flash,ranges,MAX_VERIFY_RANGES);
+  if (count<0) {
+    if (verbose) printf("Verify errors in more than %d ranges.\n",MAX_VERIFY_RANGES);
+    return 1;
+  }
 
-  for(i=0;i<ihex->ihrs_count;i++)
-    if (ihex->ihrs_records[i].ihr_type==0x00)
-      // if (ihex->ihrs_records[i].ihr_address<0xF7FE)
-      {
-	if (fail&&(verbose<2)) break;
-
-	if (memcmp(&buffer[ihex->ihrs_records[i].ihr_address],
-		   ihex->ihrs_records[i].ihr_data,
-		   ihex->ihrs_records[i].ihr_length)) {
-	  fail=1;
-	  if (verbose) {
-	    printf("Verify error in range $%04x - $%04x\n",
-		   ihex->ihrs_records[i].ihr_address,
-		   ihex->ihrs_records[i].ihr_address
-		   +ihex->ihrs_records[i].ihr_length-1);
-	    {
-	      int j;
-	      printf("Expected content:");
-	      for(j=0;j<ihex->ihrs_records[i].ihr_length;j++)
-		printf(" %02x",ihex->ihrs_records[i].ihr_data[j]);
-	      printf("\n");
-	      printf("Read from flash:");
-	      for(j=0;j<ihex->ihrs_records[i].ihr_length;j++)
-		printf(" %02x",buffer[ihex->ihrs_records[i].ihr_address+j]);
-	      printf("\n");
-	    }
-	  }
-	}
+  if (verbose) {
+    int i,j;
+    for(i=0;i<count;i++) {
+      if (i&&(verbose<2)) break;
+      printf("Verify error in range $%05x - $%05x\n",
+	     ranges[i].start,ranges[i].end-1);
+      printf("Expected content:");
+      for(j=0;j<ranges[i].end-ranges[i].start;j++)
+	printf(" %02x",ranges[i].expected[j]);
+      printf("\n");
+      printf("Read from flash:");
+      struct segment *s=segmap_find(flash,ranges[i].start);
+      for(j=ranges[i].start;j<ranges[i].end;j++)
+	printf(" %02x",s->data[j-s->start]);
+      printf("\n");
+    }
+  }
+  return count?1:0;
+}
+
+int verify_ranges(struct segment_map *map,struct segment_map *flash,
+		  struct flash_range *ranges,int max_ranges)
+{
+  // Find every run of bytes that differs from what we read from flash.
+  // Only the parts of the firmware that we actually read back are checked.
+  // Runs separated by only a few matching bytes are joined, as rewriting a
+  // couple of bytes that are already right costs less than another
+  // LOAD_ADDRESS round trip.
+  // Returns -1 if there are more than max_ranges, in which case there is
+  // no point trying to patch things up anyway.
+  struct segment_map *wanted=segmap_clip(map,flash);
+  if (!wanted) return -1;
+  int count=segmap_diff(flash,wanted,ranges,max_ranges,VERIFY_RANGE_JOIN);
+  segmap_free(wanted);
+  return count;
+}
+
+int repair_flash(int fd,struct flash_range *ranges,int count,
+		 unsigned char *buffer)
+{
+  // Flash programming can only clear bits, so a range can only be rewritten
+  // in place if every wanted byte is a subset of what is there now.
+  int i,j;
+  for(i=0;i<count;i++)
+    for(j=0;j<ranges[i].end-ranges[i].start;j++)
+      if ((buffer[ranges[i].start+j]&ranges[i].expected[j])
+	  !=ranges[i].expected[j]) {
+	printf("Range $%05x - $%05x needs bits set: must erase to repair.\n",
+	       ranges[i].start,ranges[i].end-1);
+	return -1;
       }
+
+  printf("Reprogramming %d mismatching range%s in place.\n",
+	 count,count==1?"":"s");
+  // Ranges can span 64KB banks, so start each bank afresh, as
+  // write_to_flash() does.
+  for(i=0;i<count;i++) {
+    int start=ranges[i].start,length;
+    set_flash_addr(fd,start);
+    for(j=0;j<ranges[i].end-start;j+=length) {
+      length=64;
+      if (j+length>ranges[i].end-start) length=ranges[i].end-start-j;
+      if (((start+j)>>16)!=((start+j+length-1)>>16))
+	length=0x10000-((start+j)&0xffff);
+      else if (j&&!((start+j)&0xffff))
+	set_flash_addr(fd,start+j);
+      write_flash(fd,&ranges[i].expected[j],length);
+    }
+  }
+
+  // Re-verify just the ranges we touched
+  int fail=0;
+  for(i=0;i<count;i++) {
+    int start=ranges[i].start,length;
+    set_flash_addr(fd,start);
+    for(j=0;j<ranges[i].end-start;j+=length) {
+      length=0xfc;
+      if (j+length>ranges[i].end-start) length=ranges[i].end-start-j;
+      if (((start+j)>>16)!=((start+j+length-1)>>16))
+	length=0x10000-((start+j)&0xffff);
+      else if (j&&!((start+j)&0xffff))
+	set_flash_addr(fd,start+j);
+      read_flash(fd,&buffer[start+j],length);
+    }
+    if (memcmp(&buffer[ranges[i].start],ranges[i].expected,
+	       ranges[i].end-ranges[i].start)) {
+      printf("Range $%05x - $%05x still does not verify.\n",
+	     ranges[i].start,ranges[i].end-1);
+      fail++;
+    }
+  }
+  if (!fail) printf("Repaired all mismatching ranges.\n");
   return fail;
 }
 
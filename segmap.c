@@ -0,0 +1,221 @@
+/*
+  Segment maps: firmware as a sorted list of runs of bytes.
+
+  Writing, verifying, hashing and comparing firmware all want to know
+  which flash addresses the firmware covers, and with what.  Rather than
+  each walking the intel hex records (and each dealing with extended
+  address records in its own way), or filling in a full image, they all
+  work from one sorted list of non-overlapping segments with absolute
+  addresses, which can be searched by address in O(log n).
+
+  Segments do not own their data: it belongs to the record set (or
+  buffer) that the map was made from, which must outlive the map.
+
+  (C) Serval Project Inc. 2014.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "cintelhex.h"
+#include "flash900.h"
+
+struct segment_map *segmap_new(int max_segments)
+{
+  struct segment_map *map=calloc(1,sizeof(struct segment_map));
+  if (!map) return NULL;
+  map->segments=calloc(max_segments+1,sizeof(struct segment));
+  if (!map->segments) {
+    free(map);
+    return NULL;
+  }
+  return map;
+}
+
+void segmap_free(struct segment_map *map)
+{
+  if (!map) return;
+  free(map->segments);
+  free(map);
+}
+
+// Append a run of bytes, which must come after all those already in the
+// map.  Runs that continue the previous segment, both in flash and in
+// memory, extend it instead of adding another.
+static void segmap_append(struct segment_map *map,unsigned int start,
+			  unsigned int length,unsigned char *data)
+{
+  struct segment *last=map->count?&map->segments[map->count-1]:NULL;
+  if (last&&(last->end==start)&&(last->data+(last->end-last->start)==data)) {
+    last->end+=length;
+    return;
+  }
+  map->segments[map->count].start=start;
+  map->segments[map->count].end=start+length;
+  map->segments[map->count].data=data;
+  map->count++;
+}
+
+struct segment_map *segmap_from_ihex(ihex_recordset_t *ihex)
+{
+  // Records need to be sorted and not overlap, which ihex_coalesce_records()
+  // guarantees.  Check rather than assume, as it is cheap.
+  int i,pass;
+  for(pass=0;pass<2;pass++) {
+    unsigned int address_base=0,last_end=0;
+    for(i=0;i<ihex->ihrs_count;i++) {
+      ihex_record_t *r=&ihex->ihrs_records[i];
+      if (r->ihr_type==IHEX_ELA)
+	address_base=(r->ihr_data[0]<<24)|(r->ihr_data[1]<<16);
+      else if (r->ihr_type==IHEX_ESA)
+	address_base=((r->ihr_data[0]<<8)|r->ihr_data[1])<<4;
+      else if ((r->ihr_type==IHEX_DATA)&&r->ihr_length) {
+	if (address_base+r->ihr_address<last_end) break;
+	last_end=address_base+r->ihr_address+r->ihr_length;
+      }
+    }
+    if (i==ihex->ihrs_count) break;
+    if (pass||ihex_coalesce_records(ihex)) return NULL;
+  }
+
+  struct segment_map *map=segmap_new(ihex->ihrs_count);
+  if (!map) return NULL;
+  unsigned int address_base=0;
+  for(i=0;i<ihex->ihrs_count;i++) {
+    ihex_record_t *r=&ihex->ihrs_records[i];
+    if (r->ihr_type==IHEX_ELA)
+      address_base=(r->ihr_data[0]<<24)|(r->ihr_data[1]<<16);
+    else if (r->ihr_type==IHEX_ESA)
+      address_base=((r->ihr_data[0]<<8)|r->ihr_data[1])<<4;
+    else if ((r->ihr_type==IHEX_DATA)&&r->ihr_length)
+      segmap_append(map,address_base+r->ihr_address,r->ihr_length,
+		    r->ihr_data);
+  }
+  return map;
+}
+
+int segmap_index(struct segment_map *map,unsigned int address)
+{
+  // Binary search for the first segment that ends after address
+  int lo=0,hi=map->count;
+  while(lo<hi) {
+    int mid=(lo+hi)/2;
+    if (map->segments[mid].end<=address) lo=mid+1;
+    else hi=mid;
+  }
+  return lo;
+}
+
+struct segment *segmap_find(struct segment_map *map,unsigned int address)
+{
+  int i=segmap_index(map,address);
+  if ((i<map->count)&&(map->segments[i].start<=address))
+    return &map->segments[i];
+  return NULL;
+}
+
+unsigned int segmap_covered(struct segment_map *map,
+			    unsigned int start,unsigned int end)
+{
+  unsigned int covered=0;
+  int i;
+  for(i=segmap_index(map,start);
+      (i<map->count)&&(map->segments[i].start<end);i++) {
+    unsigned int s=map->segments[i].start,e=map->segments[i].end;
+    if (s<start) s=start;
+    if (e>end) e=end;
+    covered+=e-s;
+  }
+  return covered;
+}
+
+void segmap_assemble(struct segment_map *map,unsigned char *buffer,
+		     unsigned int start,unsigned int end,unsigned char fill)
+{
+  int i;
+  memset(buffer,fill,end-start);
+  for(i=segmap_index(map,start);
+      (i<map->count)&&(map->segments[i].start<end);i++) {
+    struct segment *s=&map->segments[i];
+    unsigned int a=s->start<start?start:s->start;
+    unsigned int b=s->end>end?end:s->end;
+    memcpy(&buffer[a-start],&s->data[a-s->start],b-a);
+  }
+}
+
+int segmap_diff(struct segment_map *from,struct segment_map *to,
+		struct flash_range *ranges,int max_ranges,int join)
+{
+  // Walk both maps together, so this is linear in the number of segments
+  // plus the number of bytes in "to".
+  int count=0,i,f=0;
+  for(i=0;i<to->count;i++) {
+    struct segment *t=&to->segments[i];
+    int first_range=count;
+    unsigned int a=t->start;
+    while(a<t->end) {
+      // Find the run of "from" that a falls in, if any
+      while((f<from->count)&&(from->segments[f].end<=a)) f++;
+      struct segment *s=(f<from->count)?&from->segments[f]:NULL;
+      unsigned int run_end=t->end;
+      int have=s&&(s->start<=a);
+      if (have) { if (s->end<run_end) run_end=s->end; }
+      else if (s&&(s->start<run_end)) run_end=s->start;
+
+      for(;a<run_end;a++) {
+	if (have&&(s->data[a-s->start]==t->data[a-t->start])) continue;
+	// Join to the last range if only a few matching bytes lie between
+	if ((count>first_range)&&(ranges[count-1].end+join>=a)) {
+	  ranges[count-1].end=a+1;
+	  continue;
+	}
+	if (count>=max_ranges) return -1;
+	ranges[count].start=a;
+	ranges[count].end=a+1;
+	ranges[count].expected=&t->data[a-t->start];
+	count++;
+      }
+    }
+  }
+  return count;
+}
+
+struct segment_map *segmap_clip(struct segment_map *map,
+				struct segment_map *window)
+{
+  // The parts of map that lie within window, so at most one piece for each
+  // segment of either.
+  struct segment_map *clipped=segmap_new(map->count+window->count);
+  if (!clipped) return NULL;
+  int i,w=0;
+  for(i=0;i<map->count;i++) {
+    struct segment *s=&map->segments[i];
+    while((w<window->count)&&(window->segments[w].end<=s->start)) w++;
+    int k;
+    for(k=w;(k<window->count)&&(window->segments[k].start<s->end);k++) {
+      unsigned int a=s->start>window->segments[k].start?s->start:window->segments[k].start;
+      unsigned int b=s->end<window->segments[k].end?s->end:window->segments[k].end;
+      clipped->segments[clipped->count].start=a;
+      clipped->segments[clipped->count].end=b;
+      clipped->segments[clipped->count].data=&s->data[a-s->start];
+      clipped->count++;
+    }
+  }
+  return clipped;
+}